@@ -1,11 +1,16 @@
+#define _GNU_SOURCE // splice, pipe2, F_SETPIPE_SZ, sync_file_range, fallocate 等 Linux 扩展
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
 #include <stdarg.h>
 #include <syslog.h>
 #include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -15,22 +20,134 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE 1
+#define HAVE_SPLICE 1
+#define HAVE_FALLOCATE 1
+#define HAVE_SYNC_FILE_RANGE 1
+#define HAVE_FADVISE 1
+#elif defined(__APPLE__)
+#define HAVE_SENDFILE 1
+#endif
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // 没有时以 SO_NOSIGPIPE 代替, SIGPIPE 也已忽略
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h> // 编译时加 -DHAVE_LIBURING -luring 启用 io_uring 后端
+#endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <linux/filter.h>
+#include <sys/inotify.h>
+#define HAVE_EPOLL 1
+#define HAVE_INOTIFY 1
+#define HAVE_SETFSUID 1
+#define HAVE_ACCEPT4 1
+#define HAVE_AFFINITY 1
+#endif
+
+#define LOGSLOTS 4096 // 日志环的槽数, 须为 2 的幂
+#define LOGMSG 232    // 单条日志的最大长度
+#define LOGBATCH 64   // 写出进程一次批量写出的条数
+#define LOGSTUCK 1000000 // 槽被抢占后这么久 (微秒) 仍未发布, 视为写入方已死, 跳过该槽
+
+/* 日志环中的一条记录 */
+struct logrec {
+    unsigned long seq; // 等于写入位置时可写, 等于写入位置 + 1 时可读
+    int level;
+    int pid;
+    time_t when;
+    char msg[LOGMSG];
+};
+
+/* 所有进程和线程共享的日志环: 写入方以 CAS 抢占槽位, 不加锁; 由后台写出进程批量取出 */
+struct logring {
+    unsigned long tail;     // 下一个写入位置
+    char pad[64];           // 与读取方使用的字段分开缓存行
+    unsigned long head;     // 下一个读取位置, 只由写出进程修改
+    int level;              // 记录的最高级别, 运行时可调, -1 表示全部关闭
+    unsigned long dropped;  // 环满时丢弃的条数
+    unsigned long restarts; // 写出进程异常退出后重新启动的次数
+    struct logrec recs[LOGSLOTS];
+};
+
+struct logring* logring;  // 写出进程启动后才使用, 之前同步写出
+int loglevel = LOG_INFO;  // 启动时的日志级别
+int adminuid = -1;        // 可用 SITE LOG 调整日志级别的用户, -1 表示只能在启动时用 -l 设置
+char* logfile = NULL;     // 日志文件, 为空时写到标准错误和 syslog
+int logpid;               // 本进程的 pid, fork 后由 atfork 更新, 免得每条日志一次系统调用
+pid_t logkeeper;          // 看护写出进程的进程, 0 表示没有
+
+/* 日志级别的名字 */
+const char* logtag(int level)
+{
+    return level >= LOG_DEBUG ? "调试" : level >= LOG_INFO ? "信息" : "错误";
+}
+
+/* 记录一条日志: 低于当前级别时直接返回, 不格式化; 环满时计入丢弃数.
+ * 先格式化到局部缓冲区再抢占槽位, 抢占到发布之间只有复制, 缩小写入方死在其间的窗口 */
+void logv(int level, const char* fmt, va_list ap)
+{
+    struct logring* r = logring;
+
+    if (level > (r ? __atomic_load_n(&r->level, __ATOMIC_RELAXED) : loglevel)) {
+        return;
+    }
+
+    char buf[LOGMSG];
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+
+    if (!r) { // 写出进程尚未启动
+        fprintf(stderr, "%s: %s\n", logtag(level), buf);
+        syslog(level, "%s", buf);
+        return;
+    }
+
+    unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        struct logrec* rec = &r->recs[pos & (LOGSLOTS - 1)];
+        unsigned long seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        long dif = (long)(seq - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                rec->level = level;
+                rec->pid = logpid;
+                rec->when = time(NULL);
+                memcpy(rec->msg, buf, sizeof(buf));
+                // 写出进程可能已因超时跳过此槽, 此时放弃这条
+                __atomic_compare_exchange_n(&rec->seq, &seq, pos + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+                return;
+            }
+        } else if (dif < 0) { // 写出进程跟不上
+            __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
 
 /* 打印调试信息 */
 void p(const char* fmt, ...)
 {
     va_list p;
-    char buf[128];
-
-    va_start(p, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, p);
-    fprintf(stderr, "调试: %s\n", buf);
-    va_end(p);
 
     va_start(p, fmt);
-    syslog(LOG_DEBUG, fmt, p);
+    logv(LOG_DEBUG, fmt, p);
     va_end(p);
 }
 
@@ -38,15 +155,9 @@ void p(const char* fmt, ...)
 void pp(const char* fmt, ...)
 {
     va_list p;
-    char buf[128];
-
-    va_start(p, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, p);
-    fprintf(stderr, "信息: %s\n", buf);
-    va_end(p);
 
     va_start(p, fmt);
-    syslog(LOG_INFO, fmt, p);
+    logv(LOG_INFO, fmt, p);
     va_end(p);
 }
 
@@ -54,1130 +165,6031 @@ void pp(const char* fmt, ...)
 void pe(const char* fmt, ...)
 {
     va_list p;
-    char buf[128];
-
-    va_start(p, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, p);
-    fprintf(stderr, "错误: %s\n", buf);
-    va_end(p);
 
     va_start(p, fmt);
-    syslog(LOG_ERR, fmt, p);
+    logv(LOG_ERR, fmt, p);
     va_end(p);
 }
 
 #define MAXPATH 128
+#define XFERBUF (256 * 1024) // 无法零拷贝时传输使用的缓冲区大小
+#define XFERCHUNK (1024 * 1024) // 每一步零拷贝传输的最大字节数
+#define PIPEBUF (1024 * 1024) // splice 管道容量
+#define LINEMAX 512 // 目录列表单行的最大长度
+#define XFERPOOL 16 // 每个事件循环缓存的空闲传输缓冲区个数
+
+#define SESSION_GROUPS 64 // 事件模式下会话附加组的最大个数, 超出的不生效
+#define NOBODY 65534      // 事件模式下未登录会话访问文件的身份
+
+#define MODE_FORK 0  // 每个连接一个进程
+#define MODE_EPOLL 1 // 单进程事件循环
+#define MODE_THREADS 2 // 每个 CPU 核一个绑定的事件循环线程
 
 int timedout = 900 * 1000;
+int runmode = MODE_FORK;
+int workers = 0;       // 预先启动的工作进程数, 0 表示不使用管理进程
+int workerid = -1;     // 本工作进程的序号, -1 表示不在工作进程中
+long* workersessions;  // 各工作进程名下的会话数, 由管理进程映射, 工作进程异常退出时据此扣除
+unsigned int* workerips; // 各工作进程在地址计数表每个槽中计入的数, 同样用于异常退出时扣除
+int backlog = 128;     // 监听队列长度
+int maxsessions = 512; // 每个工作进程的最大会话数, 0 表示不限
+int useuring = 0;      // 阻塞会话经由 io_uring 执行 I/O
+int nthreads = 0;      // 线程模式下的线程数, 0 表示每个可用 CPU 一个
+int sessionmax = 0;    // 所有工作进程合计的会话上限, 达到时拒绝新连接, 0 表示不限
+double loadmax = 0;    // 一分钟平均负载超出时拒绝新连接, 0 表示不看负载
+size_t listcachemax = 16 * 1024 * 1024; // 目录列表缓存的内存预算, 0 表示不缓存
+long tunerate = 125000000;       // 估算带宽时延积所用的链路速率 (字节/秒)
+int tunemax = 16 * 1024 * 1024;  // 数据连接套接字缓冲区的上限
+int notsentlowat = 256 * 1024;   // 事件模式下数据连接的 TCP_NOTSENT_LOWAT, 0 表示不设置
+int autowmem = 4 * 1024 * 1024;  // 内核自动调整发送缓冲区的上限, 启动时读取
+int autormem = 6 * 1024 * 1024;  // 内核自动调整接收缓冲区的上限
+long writebehind = 8 * 1024 * 1024; // 上传每写满这么多字节发起回写并逐出上一个窗口, 0 表示不干预
+long dropsize = 64 * 1024 * 1024;   // 下载大于此大小的冷文件时逐出已发送的部分, 0 表示不逐出
+long shaperate[4];               // 限速 (字节/秒), 按 SHAPE_* 索引, 0 表示不限
+pthread_mutex_t pwlock = PTHREAD_MUTEX_INITIALIZER; // 保护不可重入的 crypt
 char buff[MAXPATH];
 
-struct reply {
-    struct reply* next;
-    char line[1];
+#define REPLYBUF 4096  // 每个会话待发送回复的文本缓冲区
+#define REPLYLINES 64  // 一次回复的最大行数
+#define INBUF 4096     // 控制连接的读缓冲区, 一次可读入多条流水线命令
+
+/* 数据传输的种类 */
+#define XFER_NONE 0
+#define XFER_RETR 1
+#define XFER_STOR 2
+#define XFER_LIST 3
+
+/* 上传的方式 */
+#define STOR_REPLACE 0 // STOR: 覆盖, 设置了 REST 时从偏移处续写
+#define STOR_APPEND 1  // APPE: 追加到文件末尾
+#define STOR_UNIQUE 2  // STOU: 写入新建的唯一文件
+#define PARTSUFFIX ".ftppart" // 中断上传留下的部分文件: 同目录下的 .文件名.ftppart
+#define PARTKEEP (7 * 24 * 3600) // 部分文件这么久 (秒) 未续传即过期, 在访问或列目录时删除
+
+struct evloop;
+
+#define LISTGENS 1024 // 按监视散列计数事件的槽数
+#define LISTANC 256   // 最多监视的上级目录数, 超出时不再缓存新的目录
+
+/* 缓存的目录列表输出 */
+struct listentry {
+    struct listentry* prev;
+    struct listentry* next;
+    int wd;           // 目录的 inotify 监视
+    int refs;         // 正在发送此项的传输数
+    int linked;       // 仍在缓存中
+    int stale;        // 收集时超出预算, 不再缓存
+    unsigned long gen;   // 开始收集时目录收到的事件数
+    unsigned long epoch; // 开始收集时缓存被清空的次数
+    int total;        // 条目数
+    size_t len;
+    size_t cap;
+    char key[2 * MAXPATH + 32]; // 用户, 选项和目录
+    char data[1];
+};
+
+/* 目录列表缓存, 目录变化时由 inotify 事件使对应项失效 */
+struct listcache {
+    int ifd;
+    int shared;             // 在共享内存中, 由 fork 出的会话进程共用, 操作须加锁
+    pthread_mutex_t lock;
+    char* arena;            // 共享时缓存项从这里分配
+    struct listentry* head; // 最近使用的在前
+    struct listentry* tail;
+    size_t bytes;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long epoch;    // 整个缓存被清空的次数
+    unsigned long gens[LISTGENS]; // 各监视 (按散列) 收到的事件数, 收集期间有变化的列表不放入缓存
+    int busy[LISTGENS];     // 各监视上进行中的收集数, 不为 0 时不撤销监视
+    int anc[LISTANC];       // 监视着改名和删除的上级目录
+    int nanc;
+};
+
+/* 进行中的数据传输, 按步推进以便阻塞模式和事件模式共用 */
+struct transfer {
+    int kind;
+    int fd;           // 本地文件
+    int sock;         // 数据连接
+    DIR* dir;         // 列目录时打开的目录
+    off_t start;      // 起始偏移
+    off_t pos;        // 当前偏移
+    off_t end;        // 结束偏移 (下载)
+    char* buf;        // 非零拷贝时使用的缓冲区
+    size_t len;       // 缓冲区中的有效数据
+    size_t off;       // 缓冲区中已发送的数据
+    int pfd[2];       // splice 使用的管道
+    size_t inpipe;    // 管道中尚未写出的数据
+    int fileerr;      // 失败发生在文件一侧
+    int uring;        // 经由 io_uring 传输
+    int unique;       // STOU 上传, 开始时告知文件名
+    int append;       // APPE 上传, 中断时原有内容留在原名下
+    int prealloc;     // 按 ALLO 预留了空间, 结束时释放未用完的部分
+    off_t flushed;    // 上传已发起回写到的偏移, 下载已逐出页缓存到的偏移
+    off_t advised;    // 下载已提示预读到的偏移
+    int dropcache;    // 下载的是大的冷文件, 发送后逐出页缓存
+    unsigned int heatkey; // 文件在访问计数表中的键
+    struct evloop* loop; // 所属事件循环, 从中借用缓冲区
+    int show_list;
+    int show_all;
+    int show_facts;   // MLSD 格式
+    int dirwrite;     // 可在所列目录中删除和改名 (MLSD 的 perm 事实)
+    int uid;          // 会话身份, 用于计算 perm 事实
+    int gid;
+    int total;        // 已列出的条目数
+    size_t chunk;     // 每步零拷贝传输的字节数
+    struct listentry* cached;  // 从缓存发送的列表
+    struct listentry* capture; // 正在收集以放入缓存的列表
+    struct listcache* lc;      // 收集的列表放入的缓存
+    struct xferpipe* pipe;     // 磁盘与网络重叠的流水线, 未使用时为 NULL
+    const char* method;
+    long long started;   // 数据连接建立的时刻 (单调时钟, 微秒)
+    long long firstbyte; // 首字节传输的时刻, 0 表示尚未传输
+    long long resume;    // 事件模式下因限速暂停到此时刻, 0 表示未暂停
+    char name[MAXPATH];
+    char path[MAXPATH];
+};
+
+/* 数据连接的调优结果, 由控制连接测得的往返时间决定 */
+struct tuning {
+    unsigned int rtt;     // 往返时间 (微秒), 0 表示未测得
+    unsigned int rttvar;
+    size_t bdp;           // 带宽时延积估计
+    int fixed;            // 1 表示设置了缓冲区大小, 0 表示交给内核自动调整
+    int sndbuf;           // 数据连接实际的缓冲区大小
+    int rcvbuf;
+    int lowat;            // 设置的 TCP_NOTSENT_LOWAT, 0 表示未设置
+    size_t chunk;         // 每步零拷贝传输的字节数
+};
+
+/* 事件模式下会话所处的阶段 */
+#define PH_CMD 0  // 等待命令
+#define PH_DATA 1 // 等待数据连接建立
+#define PH_XFER 2 // 正在传输数据
+#define PH_QUIT 3 // 发完回复后关闭
+#define PH_DEAD 4 // 已关闭, 等待本轮事件处理完后释放
+
+/* 事件循环 */
+struct evloop {
+    int epfd;
+    int listen_fd;
+    struct ftpstate* sessions; // 会话链表
+    struct ftpstate* dead;     // 已关闭待释放的会话
+    int nsessions;
+    int paused;                // 会话数达到上限, 暂停接受连接
+    char* bufs[XFERPOOL];      // 本循环私有的传输缓冲区, 无需加锁
+    int nbufs;
+    int reservefd;             // 预留的描述符, 描述符耗尽时借来答复积压的连接
+    struct listcache lc;       // 本循环私有的目录列表缓存
+    int throttled;             // 可能有会话因限速暂停, 需按时唤醒
+    struct ftpstate* ident;    // 本线程当前的文件访问身份属于哪个会话
 };
 
 struct ftpstate {
     int ctrlsock;
     int datasock;
     int replycode;
-    struct reply* firstreply;
-    struct reply* lastreply;
-    FILE* in;
-    FILE* out;
+    char replybuf[REPLYBUF];   // 待发送回复的各行, 以 '\0' 分隔, 发送后清空
+    size_t replylen;
+    unsigned short replyline[REPLYLINES]; // 各行在 replybuf 中的起点
+    int nreplies;
+    int replyspilled;         // 本次回复已有行因缓冲区满转入 outbuf, 之后的首行不再是多行回复的开头
+    char inbuf[INBUF];        // 控制连接读入的数据, inoff 之前的已处理
+    size_t inoff;
+    size_t inlen;
+    int inskip;               // 正在丢弃过长的命令行
+    char* outbuf;             // 待发送的回复
+    size_t outlen;
+    size_t outoff;
+    size_t outcap;
     struct sockaddr_in peer;
     char cmd[MAXPATH + 32];
     char wd[MAXPATH + 1];
     char* renamefrom;
     int uid;
+    int gid;
+    gid_t groups[SESSION_GROUPS]; // 事件模式下登录用户的附加组
+    int ngroups;
     // int epsvall;
     int loggedin;
     int guest;
-    int restartat;
+    off_t restartat;  // REST 或 RANG 设置的起始偏移
+    int ranged;       // RANG 设置了结束偏移
+    off_t rangeend;   // RANG 的结束偏移 (含)
+    off_t allocsize;  // ALLO 为下次上传预留的字节数
     int debug;
     int idletime;
     int passive;
     int dataport;
     int type;
+    int nonblock;    // 控制和数据连接为非阻塞 (事件模式)
+    int admitted;    // 已计入来源地址的会话数, 结束时须扣除
+    int connecting;  // 主动模式连接进行中
+    int ctrleof;     // 控制连接已关闭
+    struct transfer xfer;
+    struct tuning tune;
+    int shaped;               // 当前传输受限速
+    long long shapetat;       // 本会话令牌桶的理论到达时刻
+    struct evloop* loop;
+    struct ftpstate* prev;
+    struct ftpstate* next;
+    int phase;
+    int evctrl;      // 控制连接已登记的事件
+    int evdatafd;    // 已登记到 epoll 的数据描述符
+    int evdata;
+    time_t lastactive;
 };
 
-#define MAX_IP_CONNECT_NUM 5
+#define IPLIMIT_SLOTS 4096 // 按地址计数的槽数
+#define IPLIMIT_PROBES 8   // 每个地址可落入的相邻槽数
+#define IPQUOTA_MAX 64     // 可单独设置上限的地址段数
 
-struct client_limit {
-    struct sockaddr ip;
-    int fd[MAX_IP_CONNECT_NUM];
-    int len;
+/* 各地址的会话数, 所有进程和线程共享; 每个槽是一个 64 位字, 高 32 位为地址, 低 32 位为会话数,
+ * 增减和回收都是对整个字的一次原子操作. 会话数为 0 的槽可被其他地址回收 */
+struct iplimit {
+    unsigned long long slots[IPLIMIT_SLOTS];
 };
 
-/* 增加一行回复 */
-void addreply(struct ftpstate* fs, int code, const char* line, ...)
-{
-    char buf[MAXPATH + 128];
+/* 单独设置的地址段上限 */
+struct ipquota {
+    in_addr_t net;  // 网络字节序
+    in_addr_t mask;
+    int limit;
+};
 
-    if (code) {
-        fs->replycode = code;
-    }
+#define HEAT_SLOTS 4096  // 访问计数表的槽数
+#define HEAT_PROBES 8    // 每个文件可落入的相邻槽数
+#define HEAT_WINDOW 10   // 文件这么多分钟无人下载后计数重新开始
+#define HEAT_HOT 2       // 计数窗口内被下载这么多次的文件是热文件, 留在页缓存中
+#define READAHEAD (4 * 1024 * 1024) // 下载时提示预读和逐出页缓存的窗口
+
+/* 各文件的下载次数, 所有进程和线程共享; 每个槽是一个 64 位字: 高 32 位为设备号和 inode 的散列,
+ * 中间 16 位为最近一次下载的分钟数, 低 16 位为次数, 与 iplimit 一样整字做一次原子操作.
+ * 散列冲突只会让冷文件被当作热文件而留在缓存中 */
+struct fileheat {
+    unsigned long long slots[HEAT_SLOTS];
+};
 
-    va_list ap;
-    va_start(ap, line);
-    vsnprintf(buf, MAXPATH + 50, line, ap);
-    va_end(ap);
+struct fileheat* heat;
+
+struct iplimit* iplimits;
+int iplimitmax = 0; // 每个地址的会话上限, 0 表示不限
+struct ipquota ipquotas[IPQUOTA_MAX];
+int nipquotas;
+
+/* 命令属性 */
+#define CMD_LOGIN 1 // 需要登录, 未登录时先尝试匿名登录
+#define CMD_ARG 2   // 需要参数
+#define CMD_EXIT 4  // 回复后结束会话
+
+/* 命令名按 4 字节打包成整数, 查表时一次比较 */
+#define VERB(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+/* 命令表的一项 */
+struct command {
+    uint32_t verb;         // 小写命令名, 不足 4 字节的补 0
+    const char* name;
+    void (*fn)(struct ftpstate* fs, char* arg);
+    int flags;
+    const char* argname;   // 缺少参数时的提示
+    const char* help;
+    const char* feat;      // FEAT 中列出的扩展, 为空则不列出
+};
 
-    char* s = buf;
-    while (*s) {
-        char* e = s;
-        while (*e && *e != '\n') {
-            e++;
-        }
-        long l = e - s;
+extern const struct command commands[]; // 以 verb 为 0 的项结束
+unsigned long* cmdcounts; // 各命令的执行次数, 最后一项为未知命令, 所有进程共享
+
+/* 名字缓存的种类 */
+#define NC_UID 1   // uid -> 用户名
+#define NC_GID 2   // gid -> 组名
+#define NC_PWNAM 3 // 用户名 -> uid, 口令和主目录不进入共享缓存
+
+#define NAMECACHE_SLOTS 4096 // 缓存项总数
+#define NAMECACHE_WAYS 4     // 每个键可落入的相邻槽数
+#define NAMECACHE_TTL 300    // 缓存有效期 (秒)
+
+/* 名字缓存中的一项, 以序号实现无锁读写: 序号为奇数表示正在写入.
+ * 缓存对所有会话可写, 只放名字; 登录所需的口令和主目录每次从 NSS 取得 */
+struct nameentry {
+    unsigned int seq;
+    int kind;
+    int found;        // 0 表示查询失败, 名字为数字形式
+    unsigned int id;  // uid 或 gid
+    time_t expires;
+    char name[64];
+};
 
-        struct reply* r = (struct reply*)malloc(sizeof(struct reply) + l);
-        if (!r) {
-            return;
-        }
-        memcpy(r->line, s, l);
-        r->line[l] = 0;
-        r->next = NULL;
+/* 登录时取得的用户记录, 只在会话内使用 */
+struct userrec {
+    unsigned int uid;
+    unsigned int gid;
+    char name[64];
+    char dir[MAXPATH + 1];
+    char passwd[128];
+};
 
-        if (fs->lastreply) {
-            fs->lastreply->next = r;
-        } else {
-            fs->firstreply = r;
-        }
-        fs->lastreply = r;
+/* 共享的名字缓存, 在 fork 之前映射, 所有进程和线程共用 */
+struct namecache {
+    unsigned long hits;
+    unsigned long misses;
+    struct nameentry slots[NAMECACHE_SLOTS];
+};
 
-        s = e;
-        if (*s) {
-            s++;
-        }
-    }
-}
+struct namecache* names;
 
-/* 执行回复 */
-void doreply(struct ftpstate* fs)
-{
-    struct reply* r = fs->firstreply;
-    while (r) {
-        struct reply* next = r->next;
-        fprintf(fs->out, "%03d %s\r\n", fs->replycode, r->line);
-        syslog(LOG_DEBUG, "%03d %s\n", fs->replycode, r->line);
-        free(r);
-        r = next;
-    }
+#define HIST_BUCKETS 40 // 按 2 的幂分桶
 
-    fs->firstreply = fs->lastreply = NULL;
-    fflush(fs->out);
-}
+/* 按 2 的幂分桶的直方图, 第 i 桶计入 [2^i, 2^(i+1)) 的值, 0 计入第 0 桶 */
+struct histogram {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long buckets[HIST_BUCKETS];
+};
 
-/* 报告错误 */
-void doerror(struct ftpstate* fs, int code, char* fmt, ...)
+/* 一种传输的统计 */
+struct xferstat {
+    unsigned long bytes;
+    unsigned long errors;
+    struct histogram ttfb;     // 首字节时间 (微秒)
+    struct histogram duration; // 总用时 (微秒)
+    struct histogram rate;     // 吞吐 (字节/秒)
+};
+
+struct xferstat* xferstats; // 按 XFER_RETR/XFER_STOR/XFER_LIST 索引, 所有进程共享
+
+/* 拒绝连接的原因 */
+#define SHED_IP 0        // 单个地址的会话过多
+#define SHED_SESSIONS 1  // 合计会话数达到上限
+#define SHED_LOAD 2      // 系统负载过高
+#define SHED_FDS 3       // 描述符耗尽
+#define SHED_RESOURCE 4  // 无法创建进程或分配会话
+#define SHED_REASONS 5
+
+#define ACCEPT_BATCH 64  // 事件模式下每次就绪最多接受的连接数, 其余留到下一轮, 不使已有会话久等
+
+/* 全局计数和量值, 所有进程共享, 用原子操作更新 */
+struct metrics {
+    long sessions;                // 当前会话数
+    unsigned long sessions_total;
+    unsigned long logins_anon;
+    unsigned long logins_user;
+    unsigned long login_failures;
+    unsigned long bytes_in;       // 上传的字节数, 含失败的传输
+    unsigned long bytes_out;      // 下载和列目录的字节数
+    unsigned long data_failures;  // 数据连接建立失败
+    unsigned long shape_waits;    // 因限速暂停传输的次数
+    unsigned long shape_wait_us;  // 因限速暂停的总时长 (微秒)
+    unsigned long rejected[SHED_REASONS]; // 未建立会话即拒绝的连接, 按 SHED_* 分类
+    unsigned long retr_hot;       // 下载的文件是热文件
+    unsigned long retr_cold;      // 下载的是大的冷文件, 发送后逐出页缓存
+    unsigned long cache_dropped;  // 下载后请求逐出页缓存的字节数
+};
+
+struct metrics* metrics;
+char* metricsaddr = NULL; // 导出端点: 端口号 (仅 127.0.0.1) 或 unix 套接字路径, 为空时不导出
+
+#define METRIC_ADD(field, n) do { \
+    if (metrics) { \
+        __atomic_fetch_add(&metrics->field, (n), __ATOMIC_RELAXED); \
+    } \
+} while (0)
+
+/* 令牌桶的层级, 传输须同时满足全局, 所属用户类别和本会话的限速 */
+#define SHAPE_GLOBAL 0
+#define SHAPE_GUEST 1   // 匿名用户合计
+#define SHAPE_USER 2    // 登录用户合计
+#define SHAPE_SESSION 3 // 每个会话
+
+#define SHAPE_BURST 100000 // 桶容量, 以按限速传输的时长计 (微秒)
+
+/* 共享的令牌桶: 每个桶只记一个理论到达时刻, 取令牌即把它推后 字节数/速率, 一次 CAS 完成; 各占一个缓存行 */
+struct shaper {
+    struct {
+        long long tat;
+        char pad[64 - sizeof(long long)];
+    } buckets[SHAPE_SESSION];
+};
+
+struct shaper* shapers;
+
+/* 映射名字缓存 */
+void namecache_init(void)
 {
-    va_list p;
-    int err = errno;
-    if (err == 0) {
-        va_start(p, fmt);
-        pe(fmt, p);
-        va_end(p);
-        va_start(p, fmt);
-        addreply(fs, code, fmt, p);
-        va_end(p);
-    } else {
-        char* errmsg = strerror(errno);
-        char buf[128];
-        va_start(p, fmt);
-        vsnprintf(buf, sizeof(buf), fmt, p);
-        va_end(p);
-        pe("%s: %s", buf, errmsg);
-        addreply(fs, code, "%s: %s", buf, errmsg);
+    void* p = mmap(NULL, sizeof(struct namecache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        pe("映射名字缓存失败, 不使用缓存: %m");
+        return;
     }
+    names = p;
 }
 
-/* 转换路径 */
-int convert(struct ftpstate* fs, char* filename, char* buf)
+/* 缓存键的散列 */
+unsigned int namecache_hash(int kind, unsigned int id, const char* name)
 {
-    char buffer[2 * MAXPATH];
-    char* p;
-
-    if (*filename == '/' || *filename == '\\') {
-        strcpy(buffer, filename);
-    } else {
-        strcpy(buffer, fs->wd);
-        strcat(buffer, "/");
-        strcat(buffer, filename);
+    unsigned int h = 2166136261u ^ kind;
+    h = (h ^ id) * 16777619u;
+    while (name && *name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
     }
+    return h;
+}
 
-    if (realpath(buffer, buf) == NULL) {
-        return -1;
+/* 查找缓存项, 命中时复制到 out 并返回 1 */
+int namecache_get(int kind, unsigned int id, const char* name, struct nameentry* out)
+{
+    if (!names) {
+        return 0;
     }
 
-    for (p = buf; *p; p++) {
-        if (*p == '\\') {
-            *p = '/';
+    time_t now = time(NULL);
+    unsigned int h = namecache_hash(kind, name ? 0 : id, name);
+    for (int i = 0; i < NAMECACHE_WAYS; i++) {
+        struct nameentry* e = &names->slots[(h + i) % NAMECACHE_SLOTS];
+        unsigned int seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, e, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+            continue; // 读的同时被改写
+        }
+        if (out->kind == kind && out->expires > now
+                && (name ? strcmp(out->name, name) == 0 : out->id == id)) {
+            __atomic_fetch_add(&names->hits, 1, __ATOMIC_RELAXED);
+            return 1;
         }
     }
 
+    __atomic_fetch_add(&names->misses, 1, __ATOMIC_RELAXED);
     return 0;
 }
 
-/* 登录 */
-int login(struct ftpstate* fs, struct passwd* pw)
+/* 存入缓存项, 替换过期或最旧的槽; 槽正被别人写入时放弃 */
+void namecache_put(struct nameentry* in, const char* key)
 {
-    if (initgroups(pw->pw_name, pw->pw_gid) < 0) {
-        return -1;
-    }
-    if (setgid(pw->pw_gid) < 0) {
-        return -1;
-    }
-    if (setuid(pw->pw_uid) < 0) {
-        return -1;
+    if (!names) {
+        return;
     }
 
-    fs->uid = pw->pw_uid;
-    strcpy(fs->wd, pw->pw_dir);
+    unsigned int h = namecache_hash(in->kind, key ? 0 : in->id, key);
+    struct nameentry* victim = NULL;
+    for (int i = 0; i < NAMECACHE_WAYS; i++) {
+        struct nameentry* e = &names->slots[(h + i) % NAMECACHE_SLOTS];
+        if (!victim || e->expires < victim->expires) {
+            victim = e;
+        }
+    }
 
-    return 0;
+    unsigned int seq = __atomic_load_n(&victim->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    in->expires = time(NULL) + NAMECACHE_TTL;
+    memcpy((char*)victim + sizeof(victim->seq), (char*)in + sizeof(in->seq), sizeof(*in) - sizeof(in->seq));
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
-/* 打开数据连接 */
-int opendata(struct ftpstate* fs)
+/* uid 或 gid 转换为名字, 无法解析时给出数字 */
+void idname(int kind, unsigned int id, char* buf, size_t len)
 {
-    struct sockaddr_in sin;
-    int sock;
-
-    if (fs->datasock < 0) {
-        addreply(fs, 425, "无数据连接");
-        return -1;
+    struct nameentry e;
+
+    if (!namecache_get(kind, id, NULL, &e)) {
+        char tmp[2048];
+        bzero(&e, sizeof(e));
+        e.kind = kind;
+        e.id = id;
+        if (kind == NC_UID) {
+            struct passwd pwbuf, *pw = NULL;
+            getpwuid_r(id, &pwbuf, tmp, sizeof(tmp), &pw);
+            if (pw) {
+                snprintf(e.name, sizeof(e.name), "%s", pw->pw_name);
+                e.found = 1;
+            }
+        } else {
+            struct group grbuf, *gr = NULL;
+            getgrgid_r(id, &grbuf, tmp, sizeof(tmp), &gr);
+            if (gr) {
+                snprintf(e.name, sizeof(e.name), "%s", gr->gr_name);
+                e.found = 1;
+            }
+        }
+        if (!e.found) {
+            snprintf(e.name, sizeof(e.name), "%u", id);
+        }
+        namecache_put(&e, NULL);
     }
 
-    if (fs->passive) { // 被动模式
-        fd_set rs;
-        struct timeval tv;
-
-        FD_ZERO(&rs);
-        FD_SET(fs->datasock, &rs);
-        tv.tv_sec = fs->idletime;
-        tv.tv_usec = 0;
-        if (select(fs->datasock + 1, &rs, NULL, NULL, &tv) < 0) { // 等待请求
-            addreply(fs, 421, "超时 (已 %d 秒无连接)", fs->idletime);
-            return -1;
-        }
+    snprintf(buf, len, "%s", e.name);
+}
 
-        socklen_t len = sizeof(sin);
-        sock = accept(fs->datasock, (struct sockaddr*)&sin, &len);
-        if (sock < 0) {
-            doerror(fs, 421, "接受请求失败");
-            close(fs->datasock);
-            fs->datasock = -1;
-            return -1;
+/* 用户名转换为 uid, 经由名字缓存; 用户不存在时返回 -1 */
+int useruid(const char* name, unsigned int* uid)
+{
+    struct nameentry e;
+
+    if (!namecache_get(NC_PWNAM, 0, name, &e)) {
+        char tmp[4096];
+        struct passwd pwbuf, *p = NULL;
+        getpwnam_r(name, &pwbuf, tmp, sizeof(tmp), &p);
+        if (strlen(name) >= sizeof(e.name)) { // 放不下的名字不缓存, 免得截断后与别的名字相混
+            if (p) {
+                *uid = p->pw_uid;
+            }
+            return p ? 0 : -1;
         }
-
-        if (!fs->guest && sin.sin_addr.s_addr != fs->peer.sin_addr.s_addr) {
-            addreply(fs, 425, "连接必须来自 %s", inet_ntoa(fs->peer.sin_addr));
-            close(sock);
-            close(fs->datasock);
-            fs->datasock = -1;
-            return -1;
+        bzero(&e, sizeof(e));
+        e.kind = NC_PWNAM;
+        snprintf(e.name, sizeof(e.name), "%s", name);
+        if (p) {
+            e.found = 1;
+            e.id = p->pw_uid;
         }
+        namecache_put(&e, name);
+    }
 
-        addreply(fs, 150, "接受到来自 %s:%d 的请求", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-    } else { // 主动模式
-        sin.sin_addr.s_addr = fs->peer.sin_addr.s_addr;
-        sin.sin_port = htons(fs->dataport);
-        sin.sin_family = AF_INET;
+    *uid = e.id;
+    return e.found ? 0 : -1;
+}
 
-        if (connect(fs->datasock, (struct sockaddr*)&sin, sizeof(sin)) < 0) { // 主动连接
-            addreply(fs, 425, "无法打开数据连接到 %s:%d: %s", inet_ntoa(sin.sin_addr), fs->dataport, strerror(errno));
-            close(fs->datasock);
-            fs->datasock = -1;
-            return -1;
-        }
+/* 按用户名 (name 非空时) 或 uid 从 NSS 查找登录所需的用户记录, 不经过共享缓存;
+ * 结果放在 rec 中并由 pw 指向. 找不到, 或主目录, 口令放不下时返回 NULL */
+struct passwd* getuser(const char* name, unsigned int uid, struct passwd* pw, struct userrec* rec)
+{
+    char tmp[4096];
+    struct passwd pwbuf, *p = NULL;
 
-        sock = fs->datasock;
-        fs->datasock = -1;
-        addreply(fs, 150, "连接到 %s:%d", inet_ntoa(sin.sin_addr), fs->dataport);
+    if (name) {
+        getpwnam_r(name, &pwbuf, tmp, sizeof(tmp), &p);
+    } else {
+        getpwuid_r(uid, &pwbuf, tmp, sizeof(tmp), &p);
+    }
+    if (!p) {
+        return NULL;
+    }
+    if (strlen(p->pw_name) >= sizeof(rec->name) || strlen(p->pw_dir) >= sizeof(rec->dir)
+            || strlen(p->pw_passwd) >= sizeof(rec->passwd)) {
+        pe("用户 %s 的记录过长, 不允许登录", p->pw_name);
+        return NULL;
     }
 
-    return sock;
+    rec->uid = p->pw_uid;
+    rec->gid = p->pw_gid;
+    strcpy(rec->name, p->pw_name);
+    strcpy(rec->dir, p->pw_dir);
+    strcpy(rec->passwd, p->pw_passwd);
+
+    bzero(pw, sizeof(*pw));
+    pw->pw_name = rec->name;
+    pw->pw_uid = rec->uid;
+    pw->pw_gid = rec->gid;
+    pw->pw_dir = rec->dir;
+    pw->pw_passwd = rec->passwd;
+    return pw;
 }
 
-/* 验证用户 */
-void douser(struct ftpstate* fs, char* username)
+/* 取一个传输缓冲区, 事件循环中优先复用本循环的空闲缓冲区 */
+char* xferbuf_get(struct evloop* loop)
 {
-    struct passwd* pw;
+    if (loop && loop->nbufs > 0) {
+        return loop->bufs[--loop->nbufs];
+    }
+    return malloc(XFERBUF);
+}
 
-    if (fs->loggedin) {
-        if (username) {
-            if (!fs->guest) {
-                addreply(fs, 530, "您已登录");
-            } else {
-                addreply(fs, 230, "您已匿名登录");
-            }
-        }
+/* 归还传输缓冲区 */
+void xferbuf_put(struct evloop* loop, char* buf)
+{
+    if (loop && buf && loop->nbufs < XFERPOOL) {
+        loop->bufs[loop->nbufs++] = buf;
         return;
     }
+    free(buf);
+}
 
-    if (username && strcmp(username, "ftp") != 0 && strcmp(username, "anonymous") != 0) {
-        pw = getpwnam(username);
-        if (pw == NULL) {
-            addreply(fs, 331, "未知用户 %s ", username);
-        } else {
-            fs->uid = pw->pw_uid;
-            addreply(fs, 331, "用户 %s 需要密码", pw->pw_name);
-        }
+#ifdef HAVE_INOTIFY
+/* fork 模式下匿名会话共用一个映射在共享内存中的列表缓存; 登录用户的会话进程各用私有的一个,
+ * 免得它们的列表落入所有会话进程都可读写的内存. 事件模式下每个事件循环一个 */
+struct listcache* sharedcache;
+struct listcache proccache = { .ifd = -1 };
 
-        fs->loggedin = 0;
-    } else {
-        pw = getpwnam("ftp");
-        if (!pw) {
-            addreply(fs, 530, "不允许匿名用户");
-        } else {
-            if (login(fs, pw) < 0) {
-                addreply(fs, 530, "匿名用户无法登录");
-            } else {
-                addreply(fs, 230, "匿名用户登录成功");
-                fs->loggedin = fs->guest = 1;
-                pp("匿名用户登录");
+/* 共享缓存中内存块的块头, 块首尾相接铺满整个区域 */
+struct arenablk {
+    size_t size; // 含块头
+    size_t free;
+};
+
+/* 整个区域还原为一个空闲块 */
+void arena_reset(struct listcache* lc)
+{
+    struct arenablk* b = (struct arenablk*)lc->arena;
+    b->size = listcachemax;
+    b->free = 1;
+}
+
+/* 为缓存项分配内存: 共享时首次适配, 顺便合并相邻的空闲块 */
+void* listcache_alloc(struct listcache* lc, size_t n)
+{
+    if (!lc->shared) {
+        return malloc(n);
+    }
+
+    n = (n + sizeof(struct arenablk) + 15) & ~(size_t)15;
+    char* end = lc->arena + listcachemax;
+    for (char* p = lc->arena; p < end; p += ((struct arenablk*)p)->size) {
+        struct arenablk* b = (struct arenablk*)p;
+        if (!b->free) {
+            continue;
+        }
+        while (p + b->size < end && ((struct arenablk*)(p + b->size))->free) {
+            b->size += ((struct arenablk*)(p + b->size))->size;
+        }
+        if (b->size >= n) {
+            if (b->size - n >= 256) { // 余下的部分单独成块
+                struct arenablk* rest = (struct arenablk*)(p + n);
+                rest->size = b->size - n;
+                rest->free = 1;
+                b->size = n;
             }
+            b->free = 0;
+            return b + 1;
         }
     }
+    return NULL;
 }
 
-/* 验证密码 */
-void dopass(struct ftpstate* fs, char* password)
+void listcache_free(struct listcache* lc, void* ptr)
 {
-    struct passwd* pw;
-
-    if (fs->uid < 0) {
-        addreply(fs, 332, "需要用户");
-    } else if ((pw = getpwuid(fs->uid)) == NULL) {
-        addreply(fs, 331, "未知用户");
-    } else if (strcmp(pw->pw_passwd, crypt(password, pw->pw_passwd)) == 0) {
-        if (login(fs, pw) < 0) {
-            addreply(fs, 530, "用户无法登录");
-        } else {
-            fs->loggedin = 1;
-            addreply(fs, 230, "登陆成功。当前目录 %s", fs->wd);
-            pp("用户 %s 已登录", pw->pw_name);
-        }
+    if (!lc->shared) {
+        free(ptr);
     } else {
-        // p("%s %s %s", password, pw->pw_passwd, crypt(password, pw->pw_passwd));
-        // 在 OS X 中这招行不通
-        addreply(fs, 530, "密码有误");
+        ((struct arenablk*)ptr - 1)->free = 1;
     }
 }
 
-/* 切换工作目录 */
-void docwd(struct ftpstate* fs, char* dir)
+/* 映射 fork 模式下共用的列表缓存, 其 inotify 描述符由所有会话进程继承, 监视号全局一致 */
+void listcache_init(void)
 {
-    char newwd[MAXPATH];
-    struct stat st;
-
-    if (convert(fs, dir, newwd) < 0 || stat(newwd, &st) < 0) {
-        addreply(fs, 530, "无法切换目录到 %s: %s", dir, strerror(errno));
+    if (runmode != MODE_FORK || listcachemax == 0) {
         return;
     }
 
-    if (!S_ISDIR(st.st_mode)) {
-        addreply(fs, 530, "无此目录");
+    listcachemax &= ~(size_t)15;
+    size_t head = (sizeof(struct listcache) + 15) & ~(size_t)15;
+    void* p = mmap(NULL, head + listcachemax, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        pe("映射共享列表缓存失败, 各会话进程单独缓存: %m");
+        return;
+    }
+    struct listcache* lc = p;
+    lc->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (lc->ifd < 0) {
+        pe("创建 inotify 失败, 不缓存目录列表: %m");
+        munmap(p, head + listcachemax);
         return;
     }
 
-    strcpy(fs->wd, newwd);
-    addreply(fs, 250, "切换目录到 %s", fs->wd);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&lc->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    lc->shared = 1;
+    lc->arena = (char*)p + head;
+    arena_reset(lc);
+    sharedcache = lc;
 }
 
-/* 创建目录 */
-void domkd(struct ftpstate* fs, char* name)
+/* 取会话所用的列表缓存, 不可用时返回 NULL */
+struct listcache* listcache_of(struct evloop* loop, int guest)
 {
-    char filename[MAXPATH];
+    if (!loop && guest && sharedcache) {
+        return sharedcache;
+    }
 
-    convert(fs, name, filename);
+    struct listcache* lc = loop ? &loop->lc : &proccache;
 
-    if (mkdir(filename, 0755) < 0) {
-        doerror(fs, 550, "无法创建目录");
-    } else {
-        addreply(fs, 257, "目录 '%s' 创建成功", name);
+    if (lc->ifd == -1) { // 首次使用时创建 inotify 描述符
+        lc->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (lc->ifd < 0) {
+            pe("创建 inotify 失败, 不缓存目录列表: %m");
+            lc->ifd = -2;
+        }
     }
+    return lc->ifd >= 0 && listcachemax > 0 ? lc : NULL;
 }
 
-/* 移除目录 */
-void dormd(struct ftpstate* fs, char* name)
+void listcache_lock(struct listcache* lc)
 {
-    char filename[MAXPATH];
+    if (lc->shared && pthread_mutex_lock(&lc->lock) == EOWNERDEAD) {
+        // 持锁的会话进程死在操作中途, 链表可能不完整, 整个清空; 它的监视留到服务器退出
+        pthread_mutex_consistent(&lc->lock);
+        lc->head = lc->tail = NULL;
+        lc->bytes = 0;
+        lc->epoch++;
+        arena_reset(lc);
+    }
+}
 
-    if (convert(fs, name, filename) < 0) {
-        doerror(fs, 550, name);
-        return;
+void listcache_unlock(struct listcache* lc)
+{
+    if (lc->shared) {
+        pthread_mutex_unlock(&lc->lock);
     }
+}
 
-    if (rmdir(filename) < 0) {
-        doerror(fs, 550, "无法移除目录");
+/* 从双向链表中摘除 */
+void listcache_remove(struct listentry** head, struct listentry** tail, struct listentry* e)
+{
+    if (e->prev) {
+        e->prev->next = e->next;
     } else {
-        addreply(fs, 250, "目录 '%s' 移除成功", name);
+        *head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else if (tail) {
+        *tail = e->prev;
     }
+    e->prev = e->next = NULL;
 }
 
-/* 列出目录文件 */
-void dolist(struct ftpstate* fs, char* args)
+/* 没有缓存项, 进行中的收集或下级目录再用到某个监视时撤销它 */
+void listcache_unwatch(struct listcache* lc, int wd)
 {
-    char dirname[MAXPATH];
-    int show_list = 0;
-    int show_all = 0;
-
-    while (isspace(*args)) {
-        args++;
+    if (lc->busy[wd % LISTGENS]) {
+        return;
     }
-
-    while (*args == '-') {
-        while (isalnum(*++args)) {
-            switch (*args) {
-                case 'l':
-                    show_list = 1;
-                    break;
-                case 'a':
-                    show_all = 1;
-                    break;
-                default:
-                    break;
-            }
+    for (int i = 0; i < lc->nanc; i++) {
+        if (lc->anc[i] == wd) {
+            return;
         }
-
-        while (isspace(*args)) {
-            args++;
+    }
+    for (struct listentry* e = lc->head; e; e = e->next) {
+        if (e->wd == wd) {
+            return;
         }
     }
+    inotify_rm_watch(lc->ifd, wd);
+}
 
-    convert(fs, args, dirname);
-    if (dirname[0] <= ' ') {
-        dirname[0] = '.'; // 默认为当前目录
-        dirname[1] = '\0';
+/* 释放对缓存项的引用, 已移出缓存且无人使用时释放内存 */
+void listcache_release(struct listentry* e)
+{
+    if (--e->refs == 0 && !e->linked) {
+        free(e);
     }
+}
 
-    DIR* dir = opendir(dirname);
-    if (dir == NULL) {
-        doerror(fs, 550, dirname);
-        return;
+/* 把缓存项移出缓存 */
+void listcache_unlink(struct listcache* lc, struct listentry* e)
+{
+    listcache_remove(&lc->head, &lc->tail, e);
+    lc->bytes -= e->len;
+    e->linked = 0;
+    listcache_unwatch(lc, e->wd);
+    if (e->refs == 0) {
+        listcache_free(lc, e);
     }
+}
 
-    int sock = opendata(fs);
-    if (sock < 0) {
-        closedir(dir);
-        return;
+/* 清空缓存, 进行中的收集也不再放入 */
+void listcache_flush(struct listcache* lc)
+{
+    while (lc->head) {
+        listcache_unlink(lc, lc->head);
     }
-    doreply(fs);
-
-    struct dirent* d;
-    int total = 0;
-    while ((d = readdir(dir)) != NULL) {
-        char buf[MAXPATH + 128];
+    lc->epoch++;
+}
 
-        if (!show_all && d->d_name[0] == '.') { // 不显示隐藏文件
-            continue;
+/* 记下监视改名和删除的上级目录, 已满时返回 -1 */
+int listcache_anc(struct listcache* lc, int wd)
+{
+    for (int i = 0; i < lc->nanc; i++) {
+        if (lc->anc[i] == wd) {
+            return 0;
         }
-        if (show_list) {
-            struct stat st;
-            char filename[MAXPATH * 2 + 2];
-            strcpy(filename, dirname);
-            strcat(filename, "/");
-            strcat(filename, d->d_name);
+    }
+    if (lc->nanc == LISTANC) {
+        return -1;
+    }
+    lc->anc[lc->nanc++] = wd;
+    return 0;
+}
+
+/* 处理积压的 inotify 事件, 丢弃目录已变化的缓存项 */
+void listcache_drain(struct listcache* lc)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
 
-            if (stat(filename, &st) < 0) {
+    for (;;) {
+        ssize_t n = read(lc->ifd, buf, sizeof(buf));
+        if (n <= 0) {
+            return;
+        }
+        for (char* p = buf; p < buf + n;) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) { // 事件已丢失, 无从知道哪些目录变了
+                listcache_flush(lc);
                 continue;
             }
-
-            char perms[11];
-            strcpy(perms, "----------");
-            switch (st.st_mode & S_IFWHT) {
-                case S_IFREG:
-                    perms[0] = '-';
-                    break;
-                case S_IFLNK:
-                    perms[0] = 'l';
-                    break;
-                case S_IFDIR:
-                    perms[0] = 'd';
-                    break;
-                case S_IFBLK:
-                    perms[0] = 'b';
-                    break;
-                case S_IFCHR:
-                    perms[0] = 'c';
-                    break;
-                default:
-                    break;
+            lc->gens[ev->wd % LISTGENS]++;
+            if (ev->mask & IN_IGNORED) { // 监视已撤销, 目录被删除时由内核撤销
+                for (int i = 0; i < lc->nanc; i++) {
+                    if (lc->anc[i] == ev->wd) {
+                        lc->anc[i] = lc->anc[--lc->nanc];
+                        break;
+                    }
+                }
             }
-            if (st.st_mode & S_IRUSR) perms[1] = 'r';
-            if (st.st_mode & S_IWUSR) perms[2] = 'w';
-            if (st.st_mode & S_IXUSR) perms[3] = 'x';
-            if (st.st_mode & S_IRGRP) perms[4] = 'r';
-            if (st.st_mode & S_IWGRP) perms[5] = 'w';
-            if (st.st_mode & S_IXGRP) perms[6] = 'x';
-            if (st.st_mode & S_IROTH) perms[7] = 'r';
-            if (st.st_mode & S_IWOTH) perms[8] = 'w';
-            if (st.st_mode & S_IXOTH) perms[9] = 'x';
-
-            struct tm* tm;
-            if ((tm = localtime(&st.st_mtimespec.tv_sec)) == NULL) {
+            if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) { // 目录或上级目录被改名或删除, 其下的路径都可能指向了别处
+                listcache_flush(lc);
                 continue;
             }
-            char tms[20];
-            strftime(tms, 20, "%G/%m/%d %T", tm);
-
-            struct passwd* pwd = getpwuid(st.st_uid);
-            struct group* grp = getgrgid(st.st_gid);
-            if (pwd == NULL || grp == NULL) {
-                continue;
+            struct listentry* e = lc->head;
+            while (e) {
+                struct listentry* next = e->next;
+                if (e->wd == ev->wd) {
+                    listcache_unlink(lc, e);
+                }
+                e = next;
             }
+        }
+    }
+}
 
-            sprintf(buf, "%10s %3d\t%s\t%s %7lld %s %s\r\n",
-                    perms, st.st_nlink, pwd->pw_name, grp->gr_name, st.st_size, tms, d->d_name);
-        } else {
-            sprintf(buf, "%s\r\n", d->d_name);
+/* 查找列表缓存, 命中时增加引用并返回; 共享缓存返回一份私有的副本, 由 listcache_release 释放 */
+struct listentry* listcache_get(struct listcache* lc, const char* key)
+{
+    listcache_lock(lc);
+    listcache_drain(lc);
+
+    for (struct listentry* e = lc->head; e; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            listcache_remove(&lc->head, &lc->tail, e); // 移到最近使用的位置
+            e->next = lc->head;
+            if (lc->head) {
+                lc->head->prev = e;
+            } else {
+                lc->tail = e;
+            }
+            lc->head = e;
+            if (lc->shared) { // 别的进程随时可能淘汰此项, 复制一份再发送
+                struct listentry* copy = malloc(sizeof(struct listentry) + e->len);
+                if (!copy) {
+                    break;
+                }
+                memcpy(copy, e, sizeof(struct listentry) + e->len);
+                copy->prev = copy->next = NULL;
+                copy->linked = 0;
+                e = copy;
+            }
+            e->refs++;
+            lc->hits++;
+            listcache_unlock(lc);
+            return e;
         }
-        send(sock, buf, strlen(buf), 0);
-        total++;
     }
-    addreply(fs, 226, "总计 %d", total);
 
-    close(sock);
-    closedir(dir);
+    lc->misses++;
+    listcache_unlock(lc);
+    return NULL;
 }
 
-/* 取回文件 */
-void doretr(struct ftpstate* fs, char* name)
+/* 开始为一次列目录收集输出, 先建立监视以免漏掉列目录期间的变化. 上级目录被改名或替换时
+ * 这条路径就指向了别处, 而本目录收不到事件, 所以同时监视各上级目录自身的改名和删除 */
+struct listentry* listcache_begin(struct listcache* lc, const char* key, const char* dirname)
 {
-    char filename[MAXPATH];
-    struct stat st;
-    char buf[4096];
-
-    if (convert(fs, name, filename) < 0) {
-        doerror(fs, 550, name);
-        return;
+    listcache_lock(lc);
+    int wd = inotify_add_watch(lc->ifd, dirname, IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB
+            | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_MASK_ADD);
+    if (wd < 0) {
+        listcache_unlock(lc);
+        return NULL;
     }
 
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        doerror(fs, 550, "无法打开 %s", name);
-        return;
+    char up[MAXPATH];
+    snprintf(up, sizeof(up), "%s", dirname);
+    for (char* s = strrchr(up, '/'); s && s > up; s = strrchr(up, '/')) {
+        *s = '\0';
+        int aw = inotify_add_watch(lc->ifd, up, IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR | IN_MASK_ADD);
+        if (aw < 0 || listcache_anc(lc, aw) < 0) {
+            listcache_unwatch(lc, wd);
+            listcache_unlock(lc);
+            return NULL;
+        }
     }
 
-    if (fstat(fd, &st)) {
-        close(fd);
-        doerror(fs, 451, "无法获取文件大小");
-        return;
+    struct listentry* e = malloc(sizeof(struct listentry) + XFERBUF);
+    if (!e) {
+        listcache_unwatch(lc, wd);
+        listcache_unlock(lc);
+        return NULL;
     }
+    bzero(e, sizeof(*e));
+    e->cap = XFERBUF;
+    e->wd = wd;
+    e->gen = lc->gens[wd % LISTGENS];
+    e->epoch = lc->epoch;
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    lc->busy[wd % LISTGENS]++;
+    listcache_unlock(lc);
+    return e;
+}
 
-    if (fs->restartat && fs->restartat > st.st_size) {
-        addreply(fs, 451, "文件偏移位置 %d 大于文件大小 %d\n重设偏移为 0", fs->restartat, st.st_size);
-        return;
-    }
+/* 追加收集到的输出, 超出预算的四分之一时放弃缓存 */
+void listcache_append(struct listentry** ep, const char* data, size_t len)
+{
+    struct listentry* e = *ep;
 
-    if (!S_ISREG(st.st_mode)) {
-        close(fd);
-        addreply(fs, 450, "非常规文件");
+    if (e->stale) {
         return;
     }
-
-    int sock = opendata(fs);
-    if (sock < 0) {
-        close(fd);
-        return;
+    if (e->len + len > e->cap) {
+        size_t cap = e->cap * 2;
+        struct listentry* n = cap <= listcachemax / 4 ? realloc(e, sizeof(struct listentry) + cap) : NULL;
+        if (!n) {
+            e->stale = 1;
+            return;
+        }
+        e = *ep = n;
+        e->cap = cap;
     }
+    memcpy(e->data + e->len, data, len);
+    e->len += len;
+}
 
-    if (fs->restartat == st.st_size) {
-        close(fd);
-        close(sock);
-        addreply(fs, 226, "无可下载的数据\n重设偏移为 0");
+/* 结束收集: 成功且目录未变化时放入缓存, 按最近最少使用淘汰直到放得下 */
+void listcache_finish(struct listcache* lc, struct listentry* e, int ok, int total)
+{
+    listcache_lock(lc);
+    listcache_drain(lc);
+
+    int g = e->wd % LISTGENS;
+    if (!ok || e->stale || lc->gens[g] != e->gen || lc->epoch != e->epoch) {
+        lc->busy[g]--;
+        listcache_unwatch(lc, e->wd);
+        listcache_unlock(lc);
+        free(e);
         return;
     }
 
-    doreply(fs);
-
-    clock_t started = clock();
-    int i = fs->restartat;
-    if (i != 0) {
-        lseek(fd, i, SEEK_SET);
+    struct listentry* old = lc->head;
+    while (old) { // 替换同键的旧项
+        struct listentry* next = old->next;
+        if (strcmp(old->key, e->key) == 0) {
+            listcache_unlink(lc, old);
+        }
+        old = next;
     }
 
-    while (i < st.st_size) {
-        long n = st.st_size - i;
-        if (n > sizeof(buf)) {
-            n = sizeof(buf);
+    int wd = e->wd;
+    e->total = total;
+    if (lc->shared) { // 从共享区域分配, 放不下时淘汰
+        struct listentry* n;
+        while (!(n = listcache_alloc(lc, sizeof(struct listentry) + e->len)) && lc->tail) {
+            listcache_unlink(lc, lc->tail);
         }
-
-        n = read(fd, buf, n);
-        if (n <= 0) {
-            if (n == 0) {
-                addreply(fs, 451, "意外的文件结束符");
-            } else {
-                doerror(fs, 451, "读取文件出错");
-            }
-
-            close(fd);
-            close(sock);
-            return;
+        if (n) {
+            memcpy(n, e, sizeof(struct listentry) + e->len);
+            n->cap = n->len;
         }
-
-        if (send(sock, buf, n, 0) < 0) {
-            addreply(fs, 426, "传送中止");
-            close(fd);
-            close(sock);
-            return;
+        free(e);
+        e = n;
+    } else {
+        while (lc->tail && lc->bytes + e->len > listcachemax) {
+            listcache_unlink(lc, lc->tail);
         }
-
-        i += n;
     }
-
-    clock_t ended = clock();
-
-    double t = (ended - started) / 1000.0;
-    addreply(fs, 226, "文件成功写出");
-
-    double speed = 0.0;
-    if (t != 0.0 && st.st_size - fs->restartat > 0) {
-        speed = (st.st_size - fs->restartat) / t;
+    lc->busy[g]--;
+    if (!e) {
+        listcache_unwatch(lc, wd);
+        listcache_unlock(lc);
+        return;
     }
 
-    pp("用时 %.3f 秒 (服务器统计), 速度 %.2lf KB/s", t, speed / 1024 / 8);
-
-    close(fd);
-    close(sock);
-
-    if (fs->restartat != 0) {
-        fs->restartat = 0;
-        addreply(fs, 0, "重设偏移为 0");
+    e->linked = 1;
+    e->next = lc->head;
+    if (lc->head) {
+        lc->head->prev = e;
+    } else {
+        lc->tail = e;
     }
+    lc->head = e;
+    lc->bytes += e->len;
+    listcache_unlock(lc);
 }
+#endif
 
-/* 传送文件 */
-void dostor(struct ftpstate* fs, char* name)
+/* 完整发送缓冲区, 处理短写 */
+int sendall(int sock, const char* buf, size_t len)
 {
-    char filename[MAXPATH];
-    struct stat st;
-    char buf[4096];
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
 
-    convert(fs, name, filename);
+#ifdef HAVE_LIBURING
+#define URING_DEPTH 64 // 提交队列深度
+#define URING_NBUF 8   // 注册缓冲区个数, 每个 XFERBUF 字节
 
-    if (stat(filename, &st) < 0 && errno != ENOENT) {
-        doerror(fs, 553, "无法检测文件状态");
-        return;
-    }
+struct io_uring ring; // 每个进程一个环, fork 模式下即每个会话一个
+int ringready = 0;    // 0 未初始化, 1 可用, -1 不可用
+char* ringbufs[URING_NBUF];
 
-    int fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0600); // 创建文件要求有权限
-    if (fd < 0) {
-        doerror(fs, 553, "无法打开文件 %s", filename);
-        return;
+/* 初始化本进程的 io_uring 并注册传输缓冲区 */
+int uring_setup(void)
+{
+    if (ringready) {
+        return ringready > 0 ? 0 : -1;
     }
+    ringready = -1;
 
-    if (fs->restartat && lseek(fd, fs->restartat, SEEK_SET) < 0) {
-        close(fd);
-        doerror(fs, 451, "无法设定偏移量");
-        return;
+    int ret = io_uring_queue_init(URING_DEPTH, &ring, 0);
+    if (ret < 0) {
+        errno = -ret;
+        pe("初始化 io_uring 失败: %m");
+        return -1;
     }
 
-    int sock = opendata(fs);
-    if (sock < 0) {
-        close(fd);
-        return;
+    struct iovec iov[URING_NBUF];
+    for (int i = 0; i < URING_NBUF; i++) {
+        if (!ringbufs[i] && posix_memalign((void**)&ringbufs[i], 4096, XFERBUF) != 0) {
+            io_uring_queue_exit(&ring);
+            return -1;
+        }
+        iov[i].iov_base = ringbufs[i];
+        iov[i].iov_len = XFERBUF;
+    }
+    ret = io_uring_register_buffers(&ring, iov, URING_NBUF);
+    if (ret < 0) {
+        errno = -ret;
+        pe("注册 io_uring 缓冲区失败: %m");
+        io_uring_queue_exit(&ring);
+        return -1;
     }
-    doreply(fs);
 
-    clock_t started = clock();
-    for (;;) {
-        ssize_t n = recv(sock, buf, sizeof(buf), 0);
-        if (n < 0) {
-            doerror(fs, 451, "从数据连接中读取出错");
-            close(fd);
-            close(sock);
-            addreply(fs, 451, "%s %s", name, unlink(filename) ? "上传了部分" : "已移除");
-            return;
-        }
+    ringready = 1;
+    return 0;
+}
 
-        if (n == 0) {
-            break;
-        }
+/* 提交已准备好的 n 个请求并收齐完成事件, 结果按 user_data 序号存入 res */
+int uring_run(int n, int* res)
+{
+    int ret = io_uring_submit_and_wait(&ring, n);
+    if (ret < 0) {
+        return ret;
+    }
 
-        if (write(fd, buf, n) < 0) {
-            doerror(fs, 450, "写出文件出错");
-            close(fd);
-            close(sock);
-            addreply(fs, 450, "%s %s", name, unlink(filename) ? "上传了部分" : "已移除");
-            return;
+    for (int i = 0; i < n; i++) {
+        struct io_uring_cqe* cqe;
+        ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret < 0) {
+            return ret;
+        }
+        uintptr_t id = (uintptr_t)io_uring_cqe_get_data(cqe);
+        if (id < (uintptr_t)n) {
+            res[id] = cqe->res;
         }
+        io_uring_cqe_seen(&ring, cqe);
     }
-    fchmod(fd, 0644);
-    clock_t ended = clock();
-
-    double t = (ended - started) / 1000.0;
-    addreply(fs, 226, "文件成功写出");
+    return 0;
+}
 
-    if (fstat(fd, &st)) {
-        close(fd);
-        doerror(fs, 451, "无法获取文件大小");
-        return;
-    }
-    double speed = 0.0;
-    if (t != 0.0 && st.st_size - fs->restartat > 0) {
-        speed = (st.st_size - fs->restartat) / t;
+/* 提交单个请求, 超时 (毫秒) 后取消, 返回请求结果, 负值为 -errno */
+int uring_wait1(struct io_uring_sqe* sqe, int timeout)
+{
+    struct __kernel_timespec ts;
+    int res[2] = { -EIO, 0 };
+
+    io_uring_sqe_set_data(sqe, (void*)0);
+    if (timeout > 0) {
+        sqe->flags |= IOSQE_IO_LINK;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        struct io_uring_sqe* t = io_uring_get_sqe(&ring);
+        io_uring_prep_link_timeout(t, &ts, 0);
+        io_uring_sqe_set_data(t, (void*)1);
     }
 
-    pp("用时 %.3f 秒 (服务器统计), 速度 %.2lf KB/s", t, speed / 1024 / 8);
-
-    close(fd);
-    close(sock);
+    int ret = uring_run(timeout > 0 ? 2 : 1, res);
+    if (ret < 0) {
+        return ret;
+    }
+    return res[0] == -ECANCELED ? -EAGAIN : res[0]; // 与 SO_RCVTIMEO 超时一样报告 EAGAIN
+}
 
-    if (fs->restartat) {
-        fs->restartat = 0;
-        addreply(fs, 0, "重设偏移为 0");
+/* 返回结果转换为系统调用的约定 */
+ssize_t uring_result(int res)
+{
+    if (res < 0) {
+        errno = -res;
+        return -1;
     }
+    return res;
 }
+#endif
 
-/* 删除文件 */
-void dodele(struct ftpstate* fs, char* name)
+/* 阻塞会话是否经由 io_uring 执行 I/O */
+int uring_on(struct ftpstate* fs)
 {
-    char filename[MAXPATH];
+#ifdef HAVE_LIBURING
+    return useuring && !fs->nonblock && uring_setup() == 0;
+#else
+    return 0;
+#endif
+}
 
-    if (convert(fs, name, filename) < 0) {
-        doerror(fs, 550, name);
-        return;
+/* 接收, 启用 io_uring 时经由环提交 */
+ssize_t io_recv(struct ftpstate* fs, int fd, void* buf, size_t len)
+{
+#ifdef HAVE_LIBURING
+    if (uring_on(fs)) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_recv(sqe, fd, buf, len, 0);
+        return uring_result(uring_wait1(sqe, timedout));
     }
+#endif
+    return recv(fd, buf, len, 0);
+}
 
-    if (unlink(filename) < 0) {
-        addreply(fs, 550, "无法删除 '%s': %s", name, strerror(errno));
-    } else {
-        addreply(fs, 250, "已删除 '%s'", name);
+/* 发送, 启用 io_uring 时经由环提交 */
+ssize_t io_send(struct ftpstate* fs, int fd, const void* buf, size_t len)
+{
+#ifdef HAVE_LIBURING
+    if (uring_on(fs)) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_send(sqe, fd, buf, len, MSG_NOSIGNAL);
+        return uring_result(uring_wait1(sqe, timedout));
     }
+#endif
+    return send(fd, buf, len, 0);
 }
 
-/* 回应端口 */
-void doport(struct ftpstate* fs, unsigned int ip, unsigned int port)
+/* 接受连接, 启用 io_uring 时经由环提交 */
+int io_accept(struct ftpstate* fs, int fd, struct sockaddr* addr, socklen_t* len)
 {
-    struct sockaddr_in sin;
-
-    if (fs->datasock != -1) {
-        close(fs->datasock);
-        fs->datasock = -1;
+#ifdef HAVE_LIBURING
+    if (uring_on(fs)) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_accept(sqe, fd, addr, len, 0);
+        return uring_result(uring_wait1(sqe, timedout));
     }
+#endif
+    return accept(fd, addr, len);
+}
 
-    fs->datasock = socket(AF_INET, SOCK_STREAM, 0);
-    if (fs->datasock < 0) {
-        doerror(fs, 425, "无法创建套接字");
+/* 发送积压的回复, 返回 1 表示已发完, 0 表示需等待可写 (非阻塞), -1 表示出错 */
+int flushreply(struct ftpstate* fs)
+{
+    while (fs->outoff < fs->outlen) {
+        ssize_t n = io_send(fs, fs->ctrlsock, fs->outbuf + fs->outoff, fs->outlen - fs->outoff);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (fs->nonblock && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            fs->outoff = fs->outlen = 0;
+            return -1;
+        }
+        fs->outoff += n;
+    }
+
+    fs->outoff = fs->outlen = 0;
+    return 1;
+}
+
+/* 按 RFC 959 格式一次组装所有行 (多行时首行 "码-", 中间行原样, 末行 "码 "); direct 非零且没有积压时
+ * 用一次 writev 发出, 未发完的部分转入 outbuf 由 flushreply 继续发送.
+ * more 非零时后面还有行, 这些行都不作为末行, 只转入 outbuf */
+void packlines(struct ftpstate* fs, int direct, int more)
+{
+    struct iovec iov[REPLYLINES * 3];
+    char first[8], last[8];
+    int n = 0;
+
+    if (fs->nreplies == 0) {
         return;
     }
 
-    sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = INADDR_ANY;
-    sin.sin_port = htons(20); // 数据连接
-    if (bind(fs->datasock, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
-        doerror(fs, 220, "绑定套接字失败");
-        close(fs->datasock);
+    snprintf(first, sizeof(first), "%03d-", fs->replycode);
+    snprintf(last, sizeof(last), "%03d ", fs->replycode);
+    for (int i = 0; i < fs->nreplies; i++) {
+        char* line = fs->replybuf + fs->replyline[i];
+        const char* prefix = i == fs->nreplies - 1 && !more ? last
+                : i == 0 && !fs->replyspilled ? first : isdigit(line[0]) ? " " : NULL;
+        if (prefix) {
+            iov[n].iov_base = (void*)prefix;
+            iov[n++].iov_len = strlen(prefix);
+        }
+        iov[n].iov_base = line;
+        iov[n++].iov_len = strlen(line);
+        iov[n].iov_base = "\r\n";
+        iov[n++].iov_len = 2;
+    }
+    if (!more) {
+        p("%03d %s", fs->replycode, fs->replybuf + fs->replyline[fs->nreplies - 1]);
+    }
+
+    ssize_t sent = 0;
+    if (direct && !more && fs->outoff == fs->outlen && !uring_on(fs)) { // 没有积压时直接发送, 否则排在积压之后
+        do {
+            sent = writev(fs->ctrlsock, iov, n);
+        } while (sent < 0 && errno == EINTR);
+        if (sent < 0) {
+            sent = 0; // 错误留给 flushreply 报告
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        size_t l = iov[i].iov_len;
+        if ((size_t)sent >= l) {
+            sent -= l;
+            continue;
+        }
+        l -= sent;
+        if (fs->outlen + l > fs->outcap) {
+            size_t cap = fs->outcap ? fs->outcap : 512;
+            while (cap < fs->outlen + l) {
+                cap *= 2;
+            }
+            char* buf = realloc(fs->outbuf, cap);
+            if (!buf) {
+                break; // 内存不足时丢弃剩余回复
+            }
+            fs->outbuf = buf;
+            fs->outcap = cap;
+        }
+        memcpy(fs->outbuf + fs->outlen, (char*)iov[i].iov_base + sent, l);
+        fs->outlen += l;
+        sent = 0;
+    }
+
+    fs->replylen = 0;
+    fs->nreplies = 0;
+    fs->replyspilled = more;
+}
+
+/* 组装回复的其余各行, 末行带结束的回复码 */
+void packreply(struct ftpstate* fs, int direct)
+{
+    packlines(fs, direct, 0);
+}
+
+/* 增加一行回复, 文本直接格式化进会话的回复缓冲区, 其中的换行分出多行.
+ * 缓冲区或行数已满时先把已有的行作为多行回复的前几行转入 outbuf, 再放入本行; 单行超过缓冲区时截断 */
+void addreply(struct ftpstate* fs, int code, const char* line, ...)
+{
+    if (code) {
+        fs->replycode = code;
+    }
+
+    size_t room;
+    char* s;
+    int l;
+    va_list ap;
+    for (;;) {
+        room = REPLYBUF - fs->replylen;
+        s = fs->replybuf + fs->replylen;
+        l = 0;
+        if (room > 1 && fs->nreplies < REPLYLINES) {
+            va_start(ap, line);
+            l = vsnprintf(s, room, line, ap);
+            va_end(ap);
+            if ((size_t)l < room) {
+                break;
+            }
+        }
+        if (fs->nreplies == 0) {
+            break;
+        }
+        packlines(fs, 0, 1);
+    }
+    if (l <= 0) {
+        return;
+    }
+    if ((size_t)l >= room) {
+        l = room - 1;
+    }
+
+    char* end = s + l;
+    while (s < end && fs->nreplies < REPLYLINES) {
+        char* e = memchr(s, '\n', end - s);
+        if (!e) {
+            e = end;
+        }
+        *e = '\0';
+        fs->replyline[fs->nreplies++] = s - fs->replybuf;
+        s = e + 1;
+    }
+    fs->replylen = s - fs->replybuf;
+}
+
+/* 执行回复 */
+void doreply(struct ftpstate* fs)
+{
+    packreply(fs, 1);
+    flushreply(fs);
+}
+
+/* 后面还有流水线命令时只把回复转入 outbuf, 与后续回复合并发送 */
+void holdreply(struct ftpstate* fs)
+{
+    packreply(fs, 0);
+}
+
+/* 报告错误 */
+void doerror(struct ftpstate* fs, int code, char* fmt, ...)
+{
+    va_list p;
+    int err = errno;
+    char buf[128];
+
+    va_start(p, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, p);
+    va_end(p);
+    if (err == 0) {
+        pe("%s", buf);
+        addreply(fs, code, "%s", buf);
+    } else {
+        char* errmsg = strerror(err);
+        pe("%s: %s", buf, errmsg);
+        addreply(fs, code, "%s: %s", buf, errmsg);
+    }
+}
+
+/* 转换路径 */
+int convert(struct ftpstate* fs, char* filename, char* buf)
+{
+    char buffer[2 * MAXPATH];
+    char* p;
+
+    if (*filename == '/' || *filename == '\\') {
+        strcpy(buffer, filename);
+    } else {
+        strcpy(buffer, fs->wd);
+        strcat(buffer, "/");
+        strcat(buffer, filename);
+    }
+
+    if (realpath(buffer, buf) == NULL) {
+        return -1;
+    }
+
+    for (p = buf; *p; p++) {
+        if (*p == '\\') {
+            *p = '/';
+        }
+    }
+
+    return 0;
+}
+
+/* 事件模式下切换本线程的文件访问身份: fsuid, fsgid 和附加组都只作用于调用线程.
+ * glibc 的 setgroups 会同步到进程内所有线程, 故直接发起系统调用. 未登录时以 nobody 身份访问.
+ * 这些是 Linux 特有的调用; 其他平台没有事件模式, 会话都在各自的进程中以 setuid 切换身份 */
+void setident(struct ftpstate* fs, int in)
+{
+    if (fs->loop->ident == fs) {
+        return;
+    }
+#ifdef HAVE_SETFSUID
+    syscall(SYS_setgroups, in ? fs->ngroups : 0, fs->groups);
+    setfsgid(in ? fs->gid : NOBODY);
+    setfsuid(in ? fs->uid : NOBODY);
+#endif
+    fs->loop->ident = fs;
+}
+
+/* 登录 */
+int login(struct ftpstate* fs, struct passwd* pw)
+{
+    if (fs->loop) { // 事件模式下多个会话共用进程, 只记录身份, 访问文件前再切换
+        int n = SESSION_GROUPS;
+        if (getgrouplist(pw->pw_name, pw->pw_gid, fs->groups, &n) < 0) {
+            pe("用户 %s 的附加组超过 %d 个, 只有前 %d 个生效", pw->pw_name, SESSION_GROUPS, SESSION_GROUPS);
+            n = SESSION_GROUPS;
+        }
+        fs->ngroups = n;
+        fs->uid = pw->pw_uid;
+        fs->gid = pw->pw_gid;
+        strcpy(fs->wd, pw->pw_dir);
+        fs->loop->ident = NULL; // 同一批中后续命令即以新身份访问文件
+        setident(fs, 1);
+        return 0;
+    }
+
+    if (initgroups(pw->pw_name, pw->pw_gid) < 0) {
+        return -1;
+    }
+    if (setgid(pw->pw_gid) < 0) {
+        return -1;
+    }
+    if (setuid(pw->pw_uid) < 0) {
+        return -1;
+    }
+
+    fs->uid = pw->pw_uid;
+    fs->gid = pw->pw_gid;
+    strcpy(fs->wd, pw->pw_dir);
+
+    return 0;
+}
+
+/* 关闭数据描述符, 事件模式下先从 epoll 中注销 */
+void closedata(struct ftpstate* fs, int fd)
+{
+#ifdef HAVE_EPOLL
+    if (fs->loop && fd == fs->evdatafd) {
+        epoll_ctl(fs->loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+        fs->evdatafd = -1;
+    }
+#endif
+    close(fd);
+}
+
+/* 读取内核自动调整缓冲区的上限 (tcp_wmem/tcp_rmem 的第三项) */
+int tune_sysctl(const char* path, int def)
+{
+    int lo, mid, hi;
+    FILE* f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%d %d %d", &lo, &mid, &hi) == 3 && hi > 0) {
+            def = hi;
+        }
+        fclose(f);
+    }
+    return def;
+}
+
+void tune_init(void)
+{
+    autowmem = tune_sysctl("/proc/sys/net/ipv4/tcp_wmem", autowmem);
+    autormem = tune_sysctl("/proc/sys/net/ipv4/tcp_rmem", autormem);
+}
+
+/* 设置套接字缓冲区, 有权限时越过 wmem_max/rmem_max 的限制 */
+void tune_setbuf(int sock, int opt, int force, int size)
+{
+#if defined(SO_SNDBUFFORCE)
+    if (setsockopt(sock, SOL_SOCKET, force, &size, sizeof(size)) == 0) {
+        return;
+    }
+#endif
+    setsockopt(sock, SOL_SOCKET, opt, &size, sizeof(size));
+}
+
+/* 打开数据连接之前, 按控制连接测得的往返时间估计带宽时延积. 内核自动调整够用时不设置缓冲区
+ * (设置后自动调整即失效), 否则在监听或连接之前设置, 使窗口扩大因子按新的大小协商 */
+void tune_plan(struct ftpstate* fs, int sock)
+{
+    struct tuning* t = &fs->tune;
+
+    bzero(t, sizeof(*t));
+#if defined(TCP_INFO) && defined(__linux__)
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(fs->ctrlsock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0) {
+        t->rtt = ti.tcpi_rtt;
+        t->rttvar = ti.tcpi_rttvar;
+    }
+#endif
+    t->bdp = (double)tunerate * t->rtt / 1000000;
+
+    size_t want = 2 * t->bdp; // 留一倍余量给丢包恢复
+    if (want > (size_t)tunemax) {
+        want = tunemax;
+    }
+    if (want > (size_t)autowmem || want > (size_t)autormem) {
+        t->fixed = 1;
+#if defined(SO_SNDBUFFORCE)
+        tune_setbuf(sock, SO_SNDBUF, SO_SNDBUFFORCE, want);
+        tune_setbuf(sock, SO_RCVBUF, SO_RCVBUFFORCE, want);
+#else
+        tune_setbuf(sock, SO_SNDBUF, 0, want);
+        tune_setbuf(sock, SO_RCVBUF, 0, want);
+#endif
+    }
+
+    t->chunk = t->bdp < XFERBUF ? XFERBUF : t->bdp > XFERCHUNK ? XFERCHUNK : t->bdp;
+}
+
+/* 数据连接建立后: 记录实际缓冲区, 事件模式下的下载限制未发送数据量, 使可写事件只在需要补充时到来 */
+void tune_data(struct ftpstate* fs, int sock)
+{
+    struct tuning* t = &fs->tune;
+    socklen_t len = sizeof(int);
+
+    getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &t->sndbuf, &len);
+    len = sizeof(int);
+    getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &t->rcvbuf, &len);
+
+    t->lowat = 0;
+#ifdef TCP_NOTSENT_LOWAT
+    if (fs->nonblock && fs->xfer.kind != XFER_STOR && notsentlowat > 0) {
+        int lowat = notsentlowat > (int)t->chunk ? notsentlowat : (int)t->chunk;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == 0) {
+            t->lowat = lowat;
+        }
+    }
+#endif
+
+    fs->xfer.chunk = t->chunk ? t->chunk : XFERCHUNK;
+}
+
+/* 打开数据连接, 非阻塞时返回 -2 表示连接尚未就绪 */
+int opendata(struct ftpstate* fs)
+{
+    struct sockaddr_in sin;
+    int sock;
+
+    if (fs->datasock < 0) {
+        addreply(fs, 425, "无数据连接");
+        return -1;
+    }
+
+    if (fs->passive) { // 被动模式
+        if (!fs->nonblock) {
+            fd_set rs;
+            struct timeval tv;
+
+            FD_ZERO(&rs);
+            FD_SET(fs->datasock, &rs);
+            tv.tv_sec = fs->idletime;
+            tv.tv_usec = 0;
+            if (select(fs->datasock + 1, &rs, NULL, NULL, &tv) < 0) { // 等待请求
+                addreply(fs, 421, "超时 (已 %d 秒无连接)", fs->idletime);
+                return -1;
+            }
+        }
+
+        socklen_t len = sizeof(sin);
+        sock = io_accept(fs, fs->datasock, (struct sockaddr*)&sin, &len);
+        if (sock < 0) {
+            if (fs->nonblock && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return -2; // 事件模式下等待连接到来
+            }
+            doerror(fs, 421, "接受请求失败");
+            closedata(fs, fs->datasock);
+            fs->datasock = -1;
+            return -1;
+        }
+
+        if (!fs->guest && sin.sin_addr.s_addr != fs->peer.sin_addr.s_addr) {
+            addreply(fs, 425, "连接必须来自 %s", inet_ntoa(fs->peer.sin_addr));
+            close(sock);
+            closedata(fs, fs->datasock);
+            fs->datasock = -1;
+            return -1;
+        }
+
+        if (fs->nonblock) {
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        }
+
+        addreply(fs, 150, "接受到来自 %s:%d 的请求", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+    } else { // 主动模式
+        sin.sin_addr.s_addr = fs->peer.sin_addr.s_addr;
+        sin.sin_port = htons(fs->dataport);
+        sin.sin_family = AF_INET;
+
+        int ret;
+        if (fs->connecting) { // 非阻塞连接已完成, 取出结果
+            int err = 0;
+            socklen_t len = sizeof(err);
+            fs->connecting = 0;
+            ret = getsockopt(fs->datasock, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (ret == 0 && err) {
+                errno = err;
+                ret = -1;
+            }
+        } else {
+            if (fs->nonblock) {
+                fcntl(fs->datasock, F_SETFL, fcntl(fs->datasock, F_GETFL) | O_NONBLOCK);
+            }
+            ret = connect(fs->datasock, (struct sockaddr*)&sin, sizeof(sin)); // 主动连接
+            if (ret < 0 && fs->nonblock && errno == EINPROGRESS) {
+                fs->connecting = 1;
+                return -2;
+            }
+        }
+        if (ret < 0) {
+            addreply(fs, 425, "无法打开数据连接到 %s:%d: %s", inet_ntoa(sin.sin_addr), fs->dataport, strerror(errno));
+            closedata(fs, fs->datasock);
+            fs->datasock = -1;
+            return -1;
+        }
+
+        sock = fs->datasock;
         fs->datasock = -1;
+        addreply(fs, 150, "连接到 %s:%d", inet_ntoa(sin.sin_addr), fs->dataport);
+    }
+
+    return sock;
+}
+
+/* 验证用户 */
+void douser(struct ftpstate* fs, char* username)
+{
+    struct passwd pwbuf, *pw;
+    struct userrec rec;
+    unsigned int uid;
+
+    if (fs->loggedin) {
+        if (username) {
+            if (!fs->guest) {
+                addreply(fs, 530, "您已登录");
+            } else {
+                addreply(fs, 230, "您已匿名登录");
+            }
+        }
         return;
     }
 
-    if (fs->debug) {
-        addreply(fs, 0, "数据连接端在 %s:%d", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+    if (username && strcmp(username, "ftp") != 0 && strcmp(username, "anonymous") != 0) {
+        if (useruid(username, &uid) < 0) {
+            addreply(fs, 331, "未知用户 %s ", username);
+        } else {
+            fs->uid = uid; // 口令按此 uid 重新从 NSS 取得, 缓存被篡改也只会校验别人的口令
+            addreply(fs, 331, "用户 %s 需要密码", username);
+        }
+
+        fs->loggedin = 0;
+    } else {
+        pw = getuser("ftp", 0, &pwbuf, &rec);
+        if (!pw) {
+            addreply(fs, 530, "不允许匿名用户");
+        } else {
+            if (login(fs, pw) < 0) {
+                addreply(fs, 530, "匿名用户无法登录");
+            } else {
+                addreply(fs, 230, "匿名用户登录成功");
+                fs->loggedin = fs->guest = 1;
+                METRIC_ADD(logins_anon, 1);
+                pp("匿名用户登录");
+            }
+        }
+    }
+}
+
+/* 校验口令; crypt 不可重入, 线程模式下需加锁 */
+int checkpass(struct passwd* pw, const char* password)
+{
+    pthread_mutex_lock(&pwlock);
+    char* c = crypt(password, pw->pw_passwd);
+    int ok = c && strcmp(pw->pw_passwd, c) == 0;
+    pthread_mutex_unlock(&pwlock);
+    return ok;
+}
+
+/* 验证密码 */
+void dopass(struct ftpstate* fs, char* password)
+{
+    struct passwd pwbuf, *pw;
+    struct userrec rec;
+
+    if (fs->uid < 0) {
+        addreply(fs, 332, "需要用户");
+    } else if ((pw = getuser(NULL, fs->uid, &pwbuf, &rec)) == NULL) {
+        addreply(fs, 331, "未知用户");
+    } else if (checkpass(pw, password)) {
+        if (login(fs, pw) < 0) {
+            addreply(fs, 530, "用户无法登录");
+        } else {
+            fs->loggedin = 1;
+            METRIC_ADD(logins_user, 1);
+            addreply(fs, 230, "登陆成功。当前目录 %s", fs->wd);
+            pp("用户 %s 已登录", pw->pw_name);
+        }
+    } else {
+        // p("%s %s %s", password, pw->pw_passwd, crypt(password, pw->pw_passwd));
+        // 在 OS X 中这招行不通
+        METRIC_ADD(login_failures, 1);
+        addreply(fs, 530, "密码有误");
+    }
+}
+
+/* 切换工作目录 */
+void docwd(struct ftpstate* fs, char* dir)
+{
+    char newwd[MAXPATH];
+    struct stat st;
+
+    if (convert(fs, dir, newwd) < 0 || stat(newwd, &st) < 0) {
+        addreply(fs, 530, "无法切换目录到 %s: %s", dir, strerror(errno));
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        addreply(fs, 530, "无此目录");
+        return;
+    }
+
+    strcpy(fs->wd, newwd);
+    addreply(fs, 250, "切换目录到 %s", fs->wd);
+}
+
+/* 创建目录 */
+void domkd(struct ftpstate* fs, char* name)
+{
+    char filename[MAXPATH];
+
+    convert(fs, name, filename);
+
+    if (mkdir(filename, 0755) < 0) {
+        doerror(fs, 550, "无法创建目录");
+    } else {
+        addreply(fs, 257, "目录 '%s' 创建成功", name);
+    }
+}
+
+/* 移除目录 */
+void dormd(struct ftpstate* fs, char* name)
+{
+    char filename[MAXPATH];
+
+    if (convert(fs, name, filename) < 0) {
+        doerror(fs, 550, name);
+        return;
+    }
+
+    if (rmdir(filename) < 0) {
+        doerror(fs, 550, "无法移除目录");
+    } else {
+        addreply(fs, 250, "目录 '%s' 移除成功", name);
+    }
+}
+
+/* 会话身份是否具有文件的 bits (4 读, 2 写, 1 执行) 权限, 只看权限位 */
+int modeallows(const struct stat* st, int uid, int gid, int bits)
+{
+    if (uid == 0) {
+        return 1;
+    }
+    int shift = (uid_t)uid == st->st_uid ? 6 : (gid_t)gid == st->st_gid ? 3 : 0;
+    return ((st->st_mode >> shift) & bits) == bits;
+}
+
+/* 按 RFC 3659 格式化一行事实 (不含开头的空格), type 为空时由文件类型决定, dirwrite 表示所在目录可写 */
+int factline(const struct stat* st, const char* type, const char* name, int uid, int gid, int dirwrite,
+        char* buf, size_t size)
+{
+    if (!type) {
+        switch (st->st_mode & S_IFMT) {
+            case S_IFREG:
+                type = "file";
+                break;
+            case S_IFDIR:
+                type = "dir";
+                break;
+            case S_IFLNK:
+                type = "OS.unix=symlink";
+                break;
+            case S_IFBLK:
+                type = "OS.unix=blkdev";
+                break;
+            case S_IFCHR:
+                type = "OS.unix=chrdev";
+                break;
+            case S_IFIFO:
+                type = "OS.unix=fifo";
+                break;
+            default:
+                type = "OS.unix=socket";
+                break;
+        }
+    }
+
+    char perm[8];
+    int n = 0;
+    if (S_ISDIR(st->st_mode)) {
+        if (modeallows(st, uid, gid, 1)) {
+            perm[n++] = 'e'; // CWD
+        }
+        if (modeallows(st, uid, gid, 5)) {
+            perm[n++] = 'l'; // LIST
+        }
+        if (modeallows(st, uid, gid, 3)) {
+            perm[n++] = 'c'; // STOR
+            perm[n++] = 'm'; // MKD
+            perm[n++] = 'p'; // 删除其中的条目
+        }
+    } else {
+        if (modeallows(st, uid, gid, 4)) {
+            perm[n++] = 'r'; // RETR
+        }
+        if (modeallows(st, uid, gid, 2)) {
+            perm[n++] = 'w'; // STOR
+        }
+    }
+    if (dirwrite) {
+        perm[n++] = 'd'; // DELE 或 RMD
+        perm[n++] = 'f'; // RNFR
+    }
+    perm[n] = '\0';
+
+    struct tm tm;
+    char modify[16] = "19700101000000";
+    if (gmtime_r(&st->st_mtime, &tm)) {
+        strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm);
+    }
+
+    char sizefact[32] = "";
+    if (!S_ISDIR(st->st_mode)) {
+        snprintf(sizefact, sizeof(sizefact), "size=%lld;", (long long)st->st_size);
+    }
+
+    int l = snprintf(buf, size, "type=%s;%smodify=%s;perm=%s;unique=%llxU%llx; %s",
+            type, sizefact, modify, perm, (unsigned long long)st->st_dev, (unsigned long long)st->st_ino, name);
+    return l < (int)size ? l : (int)size - 1;
+}
+
+/* 格式化一个目录条目到 buf (至少 LINEMAX 字节), 返回长度, 0 表示跳过 */
+int listline(struct transfer* x, struct dirent* d, char* buf)
+{
+    size_t namelen = strlen(d->d_name);
+    size_t sufflen = sizeof(PARTSUFFIX) - 1;
+    if (d->d_name[0] == '.' && namelen > sufflen + 1 && strcmp(d->d_name + namelen - sufflen, PARTSUFFIX) == 0) {
+        struct stat st; // 顺手删除过期的部分文件
+        if (fstatat(dirfd(x->dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)
+                && time(NULL) - st.st_mtime > PARTKEEP && unlinkat(dirfd(x->dir), d->d_name, 0) == 0) {
+            return 0;
+        }
+    }
+    if (!x->show_all && d->d_name[0] == '.') { // 不显示隐藏文件
+        return 0;
+    }
+    if (x->show_facts) {
+        struct stat st;
+        if (fstatat(dirfd(x->dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            return 0;
+        }
+        const char* type = strcmp(d->d_name, ".") == 0 ? "cdir" : strcmp(d->d_name, "..") == 0 ? "pdir" : NULL;
+        int l = factline(&st, type, d->d_name, x->uid, x->gid, x->dirwrite && !type, buf, LINEMAX - 2);
+        buf[l] = '\r';
+        buf[l + 1] = '\n';
+        return l + 2;
+    }
+    if (!x->show_list) { // 只列名字时无需 stat
+        memcpy(buf, d->d_name, namelen);
+        buf[namelen] = '\r';
+        buf[namelen + 1] = '\n';
+        return namelen + 2;
+    }
+
+    struct stat st;
+    if (fstatat(dirfd(x->dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) { // 相对已打开的目录, 不必拼接路径
+        return 0;
+    }
+
+    char perms[11];
+    switch (st.st_mode & S_IFMT) {
+        case S_IFLNK:
+            perms[0] = 'l';
+            break;
+        case S_IFDIR:
+            perms[0] = 'd';
+            break;
+        case S_IFBLK:
+            perms[0] = 'b';
+            break;
+        case S_IFCHR:
+            perms[0] = 'c';
+            break;
+        default:
+            perms[0] = '-';
+            break;
+    }
+    for (int i = 0; i < 9; i++) {
+        perms[i + 1] = (st.st_mode & (0400 >> i)) ? "rwxrwxrwx"[i] : '-';
+    }
+    perms[10] = '\0';
+
+    struct tm tm;
+    if (localtime_r(&st.st_mtime, &tm) == NULL) {
+        return 0;
+    }
+    char tms[20];
+    strftime(tms, 20, "%G/%m/%d %T", &tm);
+
+    char user[64], group[64];
+    idname(NC_UID, st.st_uid, user, sizeof(user)); // 无法解析的 id 以数字显示
+    idname(NC_GID, st.st_gid, group, sizeof(group));
+
+    int l = snprintf(buf, LINEMAX, "%10s %3d\t%s\t%s %7lld %s %s\r\n",
+            perms, (int)st.st_nlink, user, group, (long long)st.st_size, tms, d->d_name);
+    if (l >= LINEMAX) { // 名字过长时截断, 仍以 CRLF 结尾
+        l = LINEMAX - 1;
+        buf[l - 2] = '\r';
+        buf[l - 1] = '\n';
+    }
+    return l;
+}
+
+/* 列目录: 条目格式化进环形缓冲区, 有空间就继续生成, 未发完的部分与新条目一起用 writev 发出.
+ * 这里 x->off 和 x->len 是已发送和已生成的累计字节数, 对 XFERBUF 取模即为环中位置 */
+int list_step(struct transfer* x)
+{
+    char line[LINEMAX];
+
+#ifdef HAVE_INOTIFY
+    if (x->cached) { // 缓存命中, 直接发送缓存的输出
+        if (x->off >= x->cached->len) {
+            return 0;
+        }
+        ssize_t n = send(x->sock, x->cached->data + x->off, x->cached->len - x->off, 0);
+        if (n < 0) {
+            return errno == EINTR ? 1 : -1;
+        }
+        x->off += n;
+        return 1;
+    }
+#endif
+
+    while (x->dir && XFERBUF - (x->len - x->off) >= LINEMAX) {
+        struct dirent* d = readdir(x->dir);
+        if (d == NULL) {
+            closedir(x->dir);
+            x->dir = NULL;
+            break;
+        }
+        int l = listline(x, d, line);
+        if (l <= 0) {
+            continue;
+        }
+
+        size_t t = x->len % XFERBUF;
+        size_t first = XFERBUF - t < (size_t)l ? XFERBUF - t : (size_t)l;
+        memcpy(x->buf + t, line, first);
+        memcpy(x->buf, line + first, l - first);
+        x->len += l;
+        x->total++;
+#ifdef HAVE_INOTIFY
+        if (x->capture) {
+            listcache_append(&x->capture, line, l);
+        }
+#endif
+    }
+
+    size_t pending = x->len - x->off;
+    if (pending == 0) {
+        return 0;
+    }
+
+    struct iovec iov[2];
+    size_t h = x->off % XFERBUF;
+    iov[0].iov_base = x->buf + h;
+    iov[0].iov_len = XFERBUF - h < pending ? XFERBUF - h : pending;
+    iov[1].iov_base = x->buf;
+    iov[1].iov_len = pending - iov[0].iov_len;
+
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+    ssize_t n = sendmsg(x->sock, &msg, x->dir ? MSG_MORE : 0); // 还有条目未生成时合并成满的段
+    if (n < 0) {
+        return errno == EINTR ? 1 : -1;
+    }
+    x->off += n;
+    return 1;
+}
+
+#define PIPE_SLOTS 4 // 流水线环中的缓冲区数, 每个 XFERBUF 字节
+
+/* 磁盘与网络重叠的流水线: 磁盘线程与会话线程经一个缓冲区环交接, 下载时磁盘线程预读、会话发送,
+ * 上传时会话接收、磁盘线程写出, 一侧慢时另一侧不必等它. 用于零拷贝不可用或受限速的阻塞会话.
+ * 槽 [tail, head) 归消费者, 其余归生产者, 只有交接时持锁 */
+struct xferpipe {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char* bufs[PIPE_SLOTS]; // 按页对齐
+    size_t lens[PIPE_SLOTS];
+    unsigned long head;     // 生产者已填满的槽数
+    unsigned long tail;     // 消费者已用完的槽数
+    int kind;
+    int fd;
+    off_t pos;              // 磁盘线程已读到或已写到的偏移
+    off_t end;              // 下载的结束偏移
+    off_t recvd;            // 上传时会话已接收的字节数
+    int done;               // 上传的数据连接已结束, 磁盘线程写完剩余的槽后退出
+    int stop;               // 会话要求磁盘线程退出 (上传时仍写完已交接的槽)
+    int exited;             // 磁盘线程已退出
+    int err;                // 磁盘一侧的错误码, -1 表示文件意外结束
+};
+
+#ifdef FTPD_BENCHMARK
+long diskdelay; // 基准测试模拟慢盘: 每次读盘前等待的微秒数
+#endif
+
+/* 读文件, 基准测试时模拟慢盘 */
+ssize_t diskread(int fd, void* buf, size_t len, off_t off)
+{
+#ifdef FTPD_BENCHMARK
+    if (diskdelay > 0) {
+        usleep(diskdelay);
+    }
+#endif
+    return pread(fd, buf, len, off);
+}
+
+/* 流水线的磁盘线程 */
+void* xferpipe_disk(void* arg)
+{
+    struct xferpipe* p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        if (p->kind == XFER_RETR) {
+            while (p->head - p->tail == PIPE_SLOTS && !p->stop) {
+                pthread_cond_wait(&p->cond, &p->lock);
+            }
+            if (p->stop || p->pos >= p->end) {
+                break;
+            }
+        } else {
+            while (p->head == p->tail && !p->done && !p->stop) {
+                pthread_cond_wait(&p->cond, &p->lock);
+            }
+            if (p->head == p->tail) {
+                break;
+            }
+        }
+
+        int slot = (p->kind == XFER_RETR ? p->head : p->tail) % PIPE_SLOTS;
+        off_t pos = p->pos;
+        size_t len = p->kind == XFER_RETR ? (p->end - pos > XFERBUF ? XFERBUF : p->end - pos) : p->lens[slot];
+        pthread_mutex_unlock(&p->lock); // 读写磁盘时不持锁
+
+        ssize_t r = 0;
+        if (p->kind == XFER_RETR) {
+            do {
+                r = diskread(p->fd, p->bufs[slot], len, pos);
+            } while (r < 0 && errno == EINTR);
+        } else {
+            while ((size_t)r < len) {
+                ssize_t m = pwrite(p->fd, p->bufs[slot] + r, len - r, pos + r);
+                if (m < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (m <= 0) {
+                    r = m < 0 ? -1 : 0;
+                    errno = m < 0 ? errno : EIO;
+                    break;
+                }
+                r += m;
+            }
+        }
+        int err = errno;
+
+        pthread_mutex_lock(&p->lock);
+        if (r <= 0) {
+            p->err = r == 0 && p->kind == XFER_RETR ? -1 : err;
+            break;
+        }
+        if (p->kind == XFER_RETR) {
+            p->lens[slot] = r;
+            p->head++;
+        } else {
+            p->tail++;
+        }
+        p->pos += r;
+        pthread_cond_broadcast(&p->cond);
+    }
+    p->exited = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* 释放流水线的内存 */
+void xferpipe_free(struct xferpipe* p)
+{
+    for (int i = 0; i < PIPE_SLOTS; i++) {
+        free(p->bufs[i]);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p);
+}
+
+/* 为传输启动流水线, 失败时返回 -1, 调用者退回串行读写 */
+int xferpipe_start(struct transfer* x)
+{
+    struct xferpipe* p = calloc(1, sizeof(struct xferpipe));
+    if (!p) {
+        return -1;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    for (int i = 0; i < PIPE_SLOTS; i++) {
+        if (posix_memalign((void**)&p->bufs[i], 4096, XFERBUF) != 0) {
+            p->bufs[i] = NULL;
+            xferpipe_free(p);
+            return -1;
+        }
+    }
+    p->kind = x->kind;
+    p->fd = x->fd;
+    p->pos = x->pos;
+    p->end = x->end;
+
+    if (pthread_create(&p->tid, NULL, xferpipe_disk, p) != 0) {
+        xferpipe_free(p);
+        return -1;
+    }
+    x->pipe = p;
+    x->method = "pipeline";
+    x->len = x->off = 0;
+    return 0;
+}
+
+/* 结束流水线: 上传时先交接已收到的不满一槽的数据, 等磁盘线程写完退出, 此后 x->pos 为已写出的偏移 */
+void xferpipe_end(struct transfer* x)
+{
+    struct xferpipe* p = x->pipe;
+
+    if (!p) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    if (p->kind == XFER_STOR && x->len > 0 && p->head - p->tail < PIPE_SLOTS) {
+        p->lens[p->head % PIPE_SLOTS] = x->len;
+        p->head++;
+    }
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->tid, NULL);
+
+    if (p->kind == XFER_STOR) {
+        x->pos = p->pos;
+        x->inpipe = 0;
+    }
+    x->len = x->off = 0;
+    x->pipe = NULL;
+    xferpipe_free(p);
+}
+
+/* 流水线下载: 发送磁盘线程已读入的槽 */
+int pipe_retr_step(struct transfer* x)
+{
+    struct xferpipe* p = x->pipe;
+
+    if (x->pos >= x->end) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    while (p->head == p->tail && !p->exited) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    if (p->head == p->tail) {
+        int err = p->err;
+        pthread_mutex_unlock(&p->lock);
+        errno = err > 0 ? err : 0; // 0 表示文件被截短
+        x->fileerr = 1;
+        return -1;
+    }
+    int slot = p->tail % PIPE_SLOTS;
+    size_t len = p->lens[slot];
+    pthread_mutex_unlock(&p->lock);
+
+    size_t n = len - x->off < x->chunk ? len - x->off : x->chunk;
+    int more = x->pos + (off_t)n < x->end ? MSG_MORE : 0;
+    ssize_t r = send(x->sock, p->bufs[slot] + x->off, n, more);
+    if (r < 0) {
+        if (errno == EINTR) {
+            return 1;
+        }
+        x->fileerr = 0;
+        return -1;
+    }
+    x->off += r;
+    x->pos += r;
+
+    if (x->off == len) { // 槽已发完, 还给磁盘线程
+        pthread_mutex_lock(&p->lock);
+        p->tail++;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        x->off = 0;
+    }
+    return 1;
+}
+
+/* 流水线上传: 接收到当前槽, 槽满或连接结束时交给磁盘线程; x->len 为当前槽中的数据量 */
+int pipe_stor_step(struct transfer* x)
+{
+    struct xferpipe* p = x->pipe;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->head - p->tail == PIPE_SLOTS && !p->exited) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    x->pos = p->pos;
+    if (p->exited) {
+        errno = p->err;
+        pthread_mutex_unlock(&p->lock);
+        x->fileerr = 1;
+        return -1;
+    }
+    int slot = p->head % PIPE_SLOTS;
+    pthread_mutex_unlock(&p->lock);
+
+    size_t room = XFERBUF - x->len;
+    ssize_t n = recv(x->sock, p->bufs[slot] + x->len, room < x->chunk ? room : x->chunk, 0);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 1;
+        }
+        x->fileerr = 0;
+        return -1;
+    }
+    x->len += n;
+    p->recvd += n;
+
+    if (n == 0 || x->len == XFERBUF) {
+        pthread_mutex_lock(&p->lock);
+        if (x->len > 0) {
+            p->lens[slot] = x->len;
+            p->head++;
+        }
+        if (n == 0) { // 连接结束, 等磁盘线程写完
+            p->done = 1;
+            pthread_cond_broadcast(&p->cond);
+            while (!p->exited) {
+                pthread_cond_wait(&p->cond, &p->lock);
+            }
+        }
+        pthread_cond_broadcast(&p->cond);
+        x->pos = p->pos;
+        int err = p->err;
+        pthread_mutex_unlock(&p->lock);
+        x->len = 0;
+        if (n == 0) {
+            x->inpipe = 0;
+            if (err) {
+                errno = err;
+                x->fileerr = 1;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    x->inpipe = p->recvd - (x->pos - x->start);
+    return 1;
+}
+
+/* 下载: 零拷贝发送一段, 不支持时改用缓冲区读写 */
+int retr_step(struct transfer* x)
+{
+    if (x->pipe) {
+        return pipe_retr_step(x);
+    }
+
+    if (x->pos >= x->end) {
+        return 0;
+    }
+
+    off_t n = x->end - x->pos;
+    if (n > (off_t)x->chunk) {
+        n = x->chunk;
+    }
+
+    if (!x->buf) {
+#if defined(__linux__)
+        ssize_t r = sendfile(x->sock, x->fd, &x->pos, n); // 内核负责推进 x->pos
+#elif defined(__APPLE__)
+        int r = sendfile(x->fd, x->sock, x->pos, &n, NULL, 0); // 出错时 n 仍为已发送字节数
+        x->pos += n;
+        if (r == 0 || (n > 0 && (errno == EAGAIN || errno == EINTR))) {
+            r = n;
+        }
+#else
+        int r = -1;
+        errno = ENOSYS;
+#endif
+        if (r > 0) {
+            return 1;
+        }
+        if (r == 0) {
+            errno = 0; // 文件被截短
+            x->fileerr = 1;
+            return -1;
+        }
+        if (errno == EINTR) {
+            return 1;
+        }
+        if (x->pos != x->start
+                || (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != ENOTSOCK)) {
+            x->fileerr = errno != EPIPE && errno != ECONNRESET && errno != EAGAIN && errno != EWOULDBLOCK;
+            return -1;
+        }
+
+        if (!x->loop && xferpipe_start(x) == 0) { // 内核不支持该文件的零拷贝, 阻塞会话由磁盘线程预读
+            return pipe_retr_step(x);
+        }
+        x->method = "read/send"; // 事件模式下退回普通读写
+        x->buf = xferbuf_get(x->loop);
+        if (!x->buf) {
+            x->fileerr = 1;
+            return -1;
+        }
+        x->len = x->off = 0;
+    }
+
+    if (x->off == x->len) {
+        if (n > XFERBUF) {
+            n = XFERBUF;
+        }
+        ssize_t r = diskread(x->fd, x->buf, n, x->pos);
+        if (r <= 0) {
+            if (r == 0) {
+                errno = 0;
+            } else if (errno == EINTR) {
+                return 1;
+            }
+            x->fileerr = 1;
+            return -1;
+        }
+        x->len = r;
+        x->off = 0;
+    }
+
+    int more = x->pos + (off_t)(x->len - x->off) < x->end ? MSG_MORE : 0; // 后面还有数据时不急于发出不满的段
+    ssize_t r = send(x->sock, x->buf + x->off, x->len - x->off, more);
+    if (r < 0) {
+        if (errno == EINTR) {
+            return 1;
+        }
+        x->fileerr = 0;
+        return -1;
+    }
+    x->off += r;
+    x->pos += r;
+    return 1;
+}
+
+/* 完整写出缓冲区, 处理短写 */
+int writeall(int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* 上传: 经由管道零拷贝写入文件, 不支持时改用大缓冲区读写 */
+int stor_step(struct transfer* x)
+{
+    if (x->pipe) {
+        return pipe_stor_step(x);
+    }
+#ifdef HAVE_SPLICE
+    if (x->pfd[0] >= 0) {
+        if (x->inpipe == 0) { // 管道已排空, 从连接读入
+            ssize_t n = splice(x->sock, NULL, x->pfd[1], NULL, x->chunk < PIPEBUF ? x->chunk : PIPEBUF,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    return 1;
+                }
+                if (x->pos != x->start || errno != EINVAL) {
+                    x->fileerr = 0;
+                    return -1;
+                }
+                goto fallback; // 套接字不支持 splice
+            }
+            if (n == 0) {
+                return 0;
+            }
+            x->inpipe = n;
+        }
+
+        while (x->inpipe > 0) { // 文件位置由内核推进
+            ssize_t m = splice(x->pfd[0], NULL, x->fd, NULL, x->inpipe, SPLICE_F_MOVE);
+            if (m <= 0) {
+                if (m < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (m < 0 && x->pos == x->start && errno == EINVAL) {
+                    // 文件不支持 splice: 先把管道中已有的数据普通写出
+                    char buf[4096];
+                    while (x->inpipe > 0) {
+                        ssize_t r = read(x->pfd[0], buf, x->inpipe < sizeof(buf) ? x->inpipe : sizeof(buf));
+                        if (r <= 0 || writeall(x->fd, buf, r) < 0) {
+                            x->fileerr = 1;
+                            return -1;
+                        }
+                        x->inpipe -= r;
+                        x->pos += r;
+                    }
+                    goto fallback;
+                }
+                if (m == 0) {
+                    errno = EIO;
+                }
+                x->fileerr = 1;
+                return -1;
+            }
+            x->inpipe -= m;
+            x->pos += m;
+        }
+        return 1;
+
+fallback:
+        x->method = "recv/write"; // 不支持 splice, 退回大缓冲区读写
+        close(x->pfd[0]);
+        close(x->pfd[1]);
+        x->pfd[0] = x->pfd[1] = -1;
+    }
+#endif
+
+    if (!x->buf && !x->loop && xferpipe_start(x) == 0) { // 阻塞会话由磁盘线程写出, 接收与写盘重叠
+        return pipe_stor_step(x);
+    }
+    if (!x->buf) {
+        x->buf = xferbuf_get(x->loop);
+        if (!x->buf) {
+            x->fileerr = 1;
+            return -1;
+        }
+    }
+
+    ssize_t n = recv(x->sock, x->buf, x->chunk < XFERBUF ? x->chunk : XFERBUF, 0);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 1;
+        }
+        x->fileerr = 0;
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    if (writeall(x->fd, x->buf, n) < 0) {
+        x->fileerr = 1;
+        return -1;
+    }
+    x->pos += n;
+    return 1;
+}
+
+#ifdef HAVE_LIBURING
+/* io_uring 下载: 一次提交一整条 读→发送 链, 使用注册缓冲区; 发送须保序, 故各组串在同一条链上 */
+int uring_retr_step(struct transfer* x)
+{
+    int res[URING_NBUF * 2];
+    size_t lens[URING_NBUF];
+
+    if (x->pos >= x->end) {
+        return 0;
+    }
+
+    int n = 0;
+    off_t off = x->pos;
+    while (n < URING_NBUF && off < x->end) {
+        lens[n] = x->end - off > XFERBUF ? XFERBUF : x->end - off;
+
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_read_fixed(sqe, x->fd, ringbufs[n], lens[n], off, n);
+        sqe->flags |= IOSQE_IO_LINK;
+        io_uring_sqe_set_data(sqe, (void*)(uintptr_t)(n * 2));
+
+        sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_send(sqe, x->sock, ringbufs[n], lens[n], MSG_WAITALL | MSG_NOSIGNAL);
+        io_uring_sqe_set_data(sqe, (void*)(uintptr_t)(n * 2 + 1));
+
+        off += lens[n];
+        n++;
+        if (n < URING_NBUF && off < x->end) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+    }
+
+    int ret = uring_run(n * 2, res);
+    if (ret < 0) {
+        errno = -ret;
+        x->fileerr = 1;
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int r = res[i * 2];
+        int s = res[i * 2 + 1];
+        if (r == -ECANCELED) {
+            break; // 前一组短读或短写使链中断, 下一步从当前位置重新提交
+        }
+        if (r <= 0) {
+            errno = -r;
+            x->fileerr = 1;
+            return -1;
+        }
+        if (s < 0 && s != -ECANCELED) {
+            errno = -s;
+            x->fileerr = 0;
+            return -1;
+        }
+        if (s < 0) {
+            s = 0;
+        }
+        if (s < r && sendall(x->sock, ringbufs[i] + s, r - s) < 0) {
+            x->fileerr = 0;
+            return -1;
+        }
+        x->pos += r;
+        if (r < lens[i] || s < r) {
+            break;
+        }
+    }
+    return 1;
+}
+
+/* io_uring 上传: 链接 接收→写入, 接收不足一个缓冲区时链中断, 再单独写出已收到的部分 */
+int uring_stor_step(struct transfer* x)
+{
+    int res[2];
+
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_recv(sqe, x->sock, ringbufs[0], XFERBUF, MSG_WAITALL);
+    sqe->flags |= IOSQE_IO_LINK;
+    io_uring_sqe_set_data(sqe, (void*)0);
+
+    sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_write_fixed(sqe, x->fd, ringbufs[0], XFERBUF, x->pos, 0);
+    io_uring_sqe_set_data(sqe, (void*)1);
+
+    int ret = uring_run(2, res);
+    if (ret < 0) {
+        errno = -ret;
+        x->fileerr = 0;
+        return -1;
+    }
+
+    int r = res[0];
+    if (r < 0) {
+        errno = -r;
+        x->fileerr = 0;
+        return -1;
+    }
+    if (r == 0) {
+        return 0;
+    }
+
+    int w = res[1] == -ECANCELED ? 0 : res[1];
+    while (w >= 0 && w < r) {
+        sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_write_fixed(sqe, x->fd, ringbufs[0] + w, r - w, x->pos + w, 0);
+        int m = uring_wait1(sqe, 0);
+        w = m <= 0 ? (m == 0 ? -EIO : m) : w + m;
+    }
+    if (w < 0) {
+        errno = -w;
+        x->fileerr = 1;
+        return -1;
+    }
+
+    x->pos += r;
+    return 1;
+}
+#endif
+
+/* 按传输种类推进一步, 返回 1 表示未完成, 0 表示完成, -1 表示出错 (非阻塞时 errno 可为 EAGAIN) */
+int xfer_kindstep(struct ftpstate* fs)
+{
+#ifdef HAVE_LIBURING
+    if (fs->xfer.uring) {
+        switch (fs->xfer.kind) {
+            case XFER_RETR:
+                return uring_retr_step(&fs->xfer);
+            case XFER_STOR:
+                return uring_stor_step(&fs->xfer);
+        }
+    }
+#endif
+    switch (fs->xfer.kind) {
+        case XFER_RETR:
+            return retr_step(&fs->xfer);
+        case XFER_STOR:
+            return stor_step(&fs->xfer);
+        case XFER_LIST:
+            return list_step(&fs->xfer);
+        default:
+            return 0;
+    }
+}
+
+/* 单调时钟, 微秒 */
+long long nowus(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* 映射全局计数 */
+void metrics_init(void)
+{
+    void* p = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        pe("映射全局计数失败, 不计数: %m");
+        return;
+    }
+    metrics = p;
+}
+
+/* 映射传输统计 */
+void xferstats_init(void)
+{
+    void* p = mmap(NULL, (XFER_LIST + 1) * sizeof(struct xferstat), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        pe("映射传输统计失败, 不统计: %m");
+        return;
+    }
+    xferstats = p;
+}
+
+/* 计入直方图 */
+void hist_add(struct histogram* h, unsigned long long v)
+{
+    int b = v ? 63 - __builtin_clzll(v) : 0;
+    if (b >= HIST_BUCKETS) {
+        b = HIST_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[b], 1, __ATOMIC_RELAXED);
+}
+
+/* 估计分位数: 返回包含该分位的桶的上界 */
+unsigned long long hist_quantile(struct histogram* h, unsigned long count, double q)
+{
+    unsigned long want = count * q, seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (seen > want) {
+            return 2ULL << i;
+        }
+    }
+    return 2ULL << (HIST_BUCKETS - 1);
+}
+
+/* 已传输的字节数 */
+long long xfer_bytes(struct transfer* x)
+{
+    return x->kind == XFER_LIST ? (long long)x->off : (long long)(x->pos - x->start + x->inpipe);
+}
+
+/* 映射共享令牌桶, 未设置全局或用户类别限速时不需要 */
+void shaper_init(void)
+{
+    if (!shaperate[SHAPE_GLOBAL] && !shaperate[SHAPE_GUEST] && !shaperate[SHAPE_USER]) {
+        return;
+    }
+    void* p = mmap(NULL, sizeof(struct shaper), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        pe("映射令牌桶失败, 只按会话限速: %m");
+        return;
+    }
+    shapers = p;
+}
+
+/* 从桶中取走 n 字节的令牌 (可透支), 返回为不超出限速还需等待的微秒数 */
+long long shape_take(long long* tat, long rate, long long now, long long n)
+{
+    if (rate <= 0) {
+        return 0;
+    }
+    long long cost = n * 1000000 / rate;
+    long long old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+    long long next;
+    do { // 空闲期间不积攒令牌, 最多允许一个桶容量的突发
+        next = (old > now ? old : now) + cost;
+    } while (!__atomic_compare_exchange_n(tat, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return next - now > SHAPE_BURST ? next - now - SHAPE_BURST : 0;
+}
+
+/* 按各层级限速计入已传输的 n 字节, 返回需等待的微秒数, 取最严的一级 */
+long long shape(struct ftpstate* fs, long long n)
+{
+    long long now = nowus();
+    long long wait = shape_take(&fs->shapetat, shaperate[SHAPE_SESSION], now, n);
+
+    if (shapers) {
+        long long w = shape_take(&shapers->buckets[SHAPE_GLOBAL].tat, shaperate[SHAPE_GLOBAL], now, n);
+        wait = w > wait ? w : wait;
+        int cls = fs->guest ? SHAPE_GUEST : SHAPE_USER;
+        w = shape_take(&shapers->buckets[cls].tat, shaperate[cls], now, n);
+        wait = w > wait ? w : wait;
+    }
+    return wait;
+}
+
+/* 本会话适用的最低限速, 0 表示不限 */
+long shape_rate(struct ftpstate* fs)
+{
+    long rates[] = { shaperate[SHAPE_GLOBAL], shaperate[fs->guest ? SHAPE_GUEST : SHAPE_USER], shaperate[SHAPE_SESSION] };
+    long rate = 0;
+    for (int i = 0; i < 3; i++) {
+        if (rates[i] > 0 && (rate == 0 || rates[i] < rate)) {
+            rate = rates[i];
+        }
+    }
+    return rate;
+}
+
+/* 记录一次传输的计时 */
+void xfer_account(struct transfer* x, int ret)
+{
+    if (!xferstats || x->kind <= XFER_NONE || x->kind > XFER_LIST) {
+        return;
+    }
+    struct xferstat* st = &xferstats[x->kind];
+    if (x->kind == XFER_STOR) {
+        METRIC_ADD(bytes_in, xfer_bytes(x));
+    } else {
+        METRIC_ADD(bytes_out, xfer_bytes(x));
+    }
+    if (ret < 0) {
+        __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    long long now = nowus();
+    long long bytes = xfer_bytes(x);
+    long long us = now - x->started;
+    __atomic_fetch_add(&st->bytes, bytes, __ATOMIC_RELAXED);
+    hist_add(&st->duration, us);
+    if (x->firstbyte) {
+        hist_add(&st->ttfb, x->firstbyte - x->started);
+    }
+    hist_add(&st->rate, us > 0 ? bytes * 1000000 / us : bytes);
+}
+
+/* 上传写后回写: 每写满一个窗口发起它的异步回写, 等上一个窗口回写完成后将其逐出页缓存,
+ * 使大上传不积压脏页, 也不挤占其他文件的缓存. 上一个窗口的回写早已发起, 等待通常立即返回.
+ * 事件循环不能等磁盘, 只发起回写, 再滞后两个窗口逐出; 仍在回写的页内核会跳过, 留给正常回收 */
+void stor_writebehind(struct transfer* x)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+    off_t lag = x->loop ? 2 * writebehind : writebehind;
+    while (writebehind > 0 && x->pos - x->flushed >= writebehind) {
+        off_t win = x->flushed;
+        sync_file_range(x->fd, win, writebehind, SYNC_FILE_RANGE_WRITE);
+        if (win - lag >= x->start) {
+            if (!x->loop) {
+                sync_file_range(x->fd, win - lag, writebehind,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            }
+            posix_fadvise(x->fd, win - lag, writebehind, POSIX_FADV_DONTNEED);
+        }
+        x->flushed += writebehind;
+    }
+#endif
+}
+
+/* 映射访问计数表, 不逐出页缓存时不需要 */
+void heat_init(void)
+{
+#ifdef HAVE_FADVISE
+    if (dropsize <= 0) {
+        return;
+    }
+    void* p = mmap(NULL, sizeof(struct fileheat), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        pe("映射访问计数表失败, 下载时不逐出页缓存: %m");
+        dropsize = 0;
+        return;
+    }
+    heat = p;
+#endif
+}
+
+/* 文件在访问计数表中的键, 0 留作空槽 */
+unsigned int heat_key(struct stat* st)
+{
+    unsigned long long ino = st->st_ino;
+    unsigned int key = namecache_hash((int)st->st_dev, (unsigned int)(ino ^ ino >> 32), NULL);
+    return key ? key : 1;
+}
+
+/* 记一次下载并返回计数窗口内的下载次数; touch 为 0 时只查询. 相邻槽都被占用时返回 0 */
+unsigned int heat_count(unsigned int key, int touch)
+{
+    if (!heat) {
+        return 0;
+    }
+
+    unsigned int now = time(NULL) / 60 & 0xffff;
+    for (int tries = 0; tries < 4; tries++) {
+        unsigned long long* spare = NULL;
+        unsigned long long seen = 0;
+        for (int i = 0; i < HEAT_PROBES; i++) {
+            unsigned long long* slot = &heat->slots[(key + i) % HEAT_SLOTS];
+            unsigned long long v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+            int stale = ((now - (v >> 16)) & 0xffff) >= HEAT_WINDOW;
+            while ((unsigned int)(v >> 32) == key) { // CAS 失败时 v 为新值, 槽可能已被回收
+                stale = ((now - (v >> 16)) & 0xffff) >= HEAT_WINDOW;
+                unsigned int hits = stale ? 0 : v & 0xffff;
+                if (!touch) {
+                    return hits;
+                }
+                if (hits < 0xffff) {
+                    hits++;
+                }
+                if (__atomic_compare_exchange_n(slot, &v, (unsigned long long)key << 32 | now << 16 | hits, 0,
+                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    return hits;
+                }
+            }
+            if ((v == 0 || stale) && !spare) {
+                spare = slot;
+                seen = v;
+            }
+        }
+        if (!touch || !spare) {
+            return 0;
+        }
+        // 同时为同一文件占槽的进程会选中同一个槽, 失败的一方重新查找时计入胜者的槽
+        if (__atomic_compare_exchange_n(spare, &seen, (unsigned long long)key << 32 | now << 16 | 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* 逐出已发送的部分; 刚发出的数据可能仍被套接字引用, 内核会跳过这些页 */
+void retr_drop(struct transfer* x, off_t upto)
+{
+#ifdef HAVE_FADVISE
+    if (upto > x->flushed) {
+        posix_fadvise(x->fd, x->flushed, upto - x->flushed, POSIX_FADV_DONTNEED);
+        METRIC_ADD(cache_dropped, upto - x->flushed);
+        x->flushed = upto;
+    }
+#endif
+}
+
+/* 下载推进后保持游标前方一个窗口的预读; 大的冷文件滞后一个窗口逐出已发送的部分,
+ * 期间其他会话开始下载同一文件而使它变热时停止逐出 */
+void retr_cache(struct transfer* x)
+{
+#ifdef HAVE_FADVISE
+    while (x->advised < x->end && x->advised - x->pos < READAHEAD / 2) {
+        off_t n = x->end - x->advised < READAHEAD ? x->end - x->advised : READAHEAD;
+        posix_fadvise(x->fd, x->advised, n, POSIX_FADV_WILLNEED);
+        x->advised += n;
+    }
+    if (x->dropcache && x->pos - x->flushed >= 2 * READAHEAD) {
+        if (heat_count(x->heatkey, 0) >= HEAT_HOT) {
+            x->dropcache = 0;
+            return;
+        }
+        retr_drop(x, x->pos - READAHEAD);
+    }
+#endif
+}
+
+/* 下载开始: 告知内核顺序读取并预读第一个窗口, 与建立数据连接重叠; 记一次下载并决定是否逐出 */
+void retr_cache_begin(struct transfer* x, const char* name, struct stat* st)
+{
+#ifdef HAVE_FADVISE
+    posix_fadvise(x->fd, x->start, x->end - x->start, POSIX_FADV_SEQUENTIAL);
+    x->advised = x->flushed = x->start;
+    x->heatkey = heat_key(st);
+    unsigned int hits = heat_count(x->heatkey, 1);
+    if (hits >= HEAT_HOT) {
+        METRIC_ADD(retr_hot, 1);
+    } else if (heat && st->st_size > dropsize) {
+        x->dropcache = 1;
+        METRIC_ADD(retr_cold, 1);
+    }
+    pp("%s 在 %d 分钟内下载 %u 次, %s", name, HEAT_WINDOW, hits,
+            x->dropcache ? "发送后逐出页缓存" : "保留在页缓存中");
+    retr_cache(x);
+#endif
+}
+
+/* 推进当前传输一步并记录首字节时刻, 返回值同 xfer_kindstep */
+int xfer_step(struct ftpstate* fs)
+{
+    struct transfer* x = &fs->xfer;
+
+    long long before = xfer_bytes(x);
+    int ret = xfer_kindstep(fs);
+    if (!x->firstbyte && ret > 0 && xfer_bytes(x) > 0) {
+        x->firstbyte = nowus();
+    }
+    if (ret > 0 && x->kind == XFER_STOR) {
+        stor_writebehind(x);
+    }
+    if (ret > 0 && x->kind == XFER_RETR) {
+        retr_cache(x);
+    }
+
+    if (ret > 0 && x->kind != XFER_LIST && fs->shaped) {
+        long long wait = shape(fs, xfer_bytes(x) - before);
+        if (wait > 0) {
+            METRIC_ADD(shape_waits, 1);
+            METRIC_ADD(shape_wait_us, wait);
+            if (fs->loop) { // 不占用事件循环, 到时由循环唤醒
+                x->resume = nowus() + wait;
+                fs->loop->throttled = 1;
+            } else {
+                struct timespec ts = { wait / 1000000, wait % 1000000 * 1000 };
+                while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+                }
+            }
+        }
+    }
+    return ret;
+}
+
+/* 释放传输占用的资源 */
+void xfer_close(struct ftpstate* fs)
+{
+    struct transfer* x = &fs->xfer;
+
+    xferpipe_end(x); // 先停磁盘线程, 再关闭它使用的文件
+    if (x->dropcache) { // 连同已预读但未发送的部分
+        retr_drop(x, x->advised > x->pos ? x->advised : x->pos);
+    }
+    if (x->sock >= 0) {
+        closedata(fs, x->sock);
+    }
+    if (x->fd >= 0) {
+        close(x->fd);
+    }
+    if (x->dir) {
+        closedir(x->dir);
+    }
+    if (x->pfd[0] >= 0) {
+        close(x->pfd[0]);
+        close(x->pfd[1]);
+    }
+    xferbuf_put(fs->loop, x->buf);
+#ifdef HAVE_INOTIFY
+    if (x->cached) {
+        listcache_release(x->cached);
+    }
+    if (x->capture) { // 未完成的收集不放入缓存
+        listcache_finish(x->lc, x->capture, 0, 0);
+    }
+#endif
+
+    bzero(x, sizeof(*x));
+    x->kind = XFER_NONE;
+    x->fd = x->sock = x->pfd[0] = x->pfd[1] = -1;
+}
+
+/* 开始一次传输, 由各命令准备好 fs->xfer 后调用 */
+void xfer_begin(struct ftpstate* fs, int kind)
+{
+    struct transfer* x = &fs->xfer;
+
+    x->kind = kind;
+    x->loop = fs->loop;
+    x->sock = -1;
+    x->pfd[0] = x->pfd[1] = -1;
+    x->fileerr = 0;
+    x->pos = x->start;
+    x->flushed = x->start;
+    x->method = kind == XFER_RETR ? "sendfile" : kind == XFER_STOR ? "splice" : "list";
+    if (kind != XFER_LIST && uring_on(fs)) {
+        x->uring = 1;
+        x->method = "io_uring";
+    }
+}
+
+/* 部分文件的路径: 同目录下的 .文件名.ftppart */
+void partname(const char* path, char* buf, size_t len)
+{
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    snprintf(buf, len, "%.*s.%s" PARTSUFFIX, (int)(base - path), path, base);
+}
+
+/* path 是否留有可续传的部分文件: 须是常规文件 (不跟随符号链接) 且未过期, 过期的顺手删除. 成功时填 st */
+int partfile(const char* path, char* part, size_t len, struct stat* st)
+{
+    partname(path, part, len);
+    if (lstat(part, st) < 0 || !S_ISREG(st->st_mode)) {
+        return -1;
+    }
+    if (time(NULL) - st->st_mtime > PARTKEEP) {
+        unlink(part);
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+/* 名字不存在时 (convert 以 ENOENT 失败, path 中是完整路径) 查找它中断上传留下的部分文件 */
+int partof(const char* name, const char* path, char* part, size_t len, struct stat* st)
+{
+    const char* base = strrchr(name, '/');
+    const char* pbase = strrchr(path, '/');
+    if (errno != ENOENT || strcmp(base ? base + 1 : name, pbase ? pbase + 1 : path) != 0) { // 缺的是中间的目录
+        return -1;
+    }
+    return partfile(path, part, len, st);
+}
+
+/* 上传中断: 截到最后写出的字节并落盘. STOR 和 STOU 的文件移为部分文件, 原名下不留不完整的内容;
+ * 客户端用 SIZE 查到已保留的大小后以 REST+STOR 续传, 届时移回原名. APPE 之前的内容本是完整的, 留在原名下.
+ * 事件循环不能等磁盘, 只发起剩余部分的回写而不等它落盘, 阻塞的每连接进程才就地 fdatasync */
+void stor_keep(struct ftpstate* fs, int code)
+{
+    struct transfer* x = &fs->xfer;
+    char part[MAXPATH + 16];
+
+    if (ftruncate(x->fd, x->pos) < 0) {
+        addreply(fs, code, "%s 上传了部分", x->name);
+        return;
+    }
+    if (!x->loop && fdatasync(x->fd) < 0) {
+        addreply(fs, code, "%s 上传了部分", x->name);
+        return;
+    }
+#ifdef HAVE_SYNC_FILE_RANGE
+    if (x->loop) {
+        sync_file_range(x->fd, x->flushed, 0, SYNC_FILE_RANGE_WRITE);
+    }
+#endif
+    if (!x->append) {
+        partname(x->path, part, sizeof(part));
+        if (rename(x->path, part) < 0) {
+            pe("无法将 %s 移为部分文件: %m", x->name);
+            addreply(fs, code, "%s 上传了部分", x->name);
+            return;
+        }
+    }
+    addreply(fs, code, "%s 已保留 %lld 字节, 可用 REST %lld 续传", x->name, (long long)x->pos, (long long)x->pos);
+}
+
+/* 传输结束, 根据结果回复并清理 */
+void xfer_done(struct ftpstate* fs, int ret)
+{
+    struct transfer* x = &fs->xfer;
+    xferpipe_end(x); // 此后 x->pos 为实际写出的偏移
+    long long us = nowus() - x->started;
+    long long bytes = xfer_bytes(x);
+
+    xfer_account(x, ret);
+
+    if (x->kind == XFER_LIST) {
+        if (ret < 0) {
+            addreply(fs, 426, "传送中止");
+        } else {
+            addreply(fs, 226, "总计 %d", x->total);
+#ifdef HAVE_INOTIFY
+            if (x->capture) {
+                listcache_finish(x->lc, x->capture, 1, x->total);
+                x->capture = NULL;
+            }
+#endif
+        }
+        xfer_close(fs);
+        return;
+    }
+
+    if (x->kind == XFER_RETR && ret == 0 && x->start == x->end) {
+        addreply(fs, 226, "无可下载的数据\n重设偏移为 0");
+        fs->restartat = 0;
+        fs->ranged = 0;
+        xfer_close(fs);
+        return;
+    }
+
+    if (ret < 0) {
+        if (x->kind == XFER_RETR) {
+            if (errno == 0) {
+                addreply(fs, 451, "意外的文件结束符");
+            } else if (x->fileerr) {
+                doerror(fs, 451, "读取文件出错");
+            } else {
+                addreply(fs, 426, "传送中止");
+            }
+        } else if (x->fileerr) {
+            doerror(fs, 450, "写出文件出错");
+            stor_keep(fs, 450);
+        } else {
+            doerror(fs, 451, "从数据连接中读取出错");
+            stor_keep(fs, 451);
+        }
+        pe("传输方式 %s, 在偏移 %lld 处失败", x->method, (long long)x->pos);
+        xfer_close(fs);
+        return;
+    }
+
+    if (x->kind == XFER_STOR) {
+        char part[MAXPATH + 16];
+        struct stat st;
+        if (x->prealloc && fstat(x->fd, &st) == 0 && ftruncate(x->fd, st.st_size) < 0) { // 释放文件末尾之后未用完的预留
+            pe("释放 %s 未用完的预留空间失败: %m", x->name);
+        }
+#ifdef HAVE_SYNC_FILE_RANGE
+        if (writebehind > 0) {
+            sync_file_range(x->fd, x->flushed, 0, SYNC_FILE_RANGE_WRITE); // 剩余部分也开始回写, 不等待
+        }
+#endif
+        fchmod(x->fd, 0644);
+        partname(x->path, part, sizeof(part));
+        unlink(part); // 已完整上传, 此前中断留下的部分文件作废
+    }
+    addreply(fs, 226, "文件成功写出");
+
+    double speed = us > 0 ? bytes * 1e6 / us : 0.0;
+    pp("传输方式 %s, %lld 字节, 首字节 %.3f 毫秒, 用时 %.3f 秒, 速度 %.2lf KB/s", x->method, bytes,
+            x->firstbyte ? (x->firstbyte - x->started) / 1e3 : 0.0, us / 1e6, speed / 1024);
+
+    xfer_close(fs);
+
+    if (fs->restartat != 0 || fs->ranged) {
+        fs->restartat = 0;
+        fs->ranged = 0;
+        addreply(fs, 0, "重设偏移为 0");
+    }
+}
+
+/* 数据连接就绪后开始传输 */
+void xfer_connected(struct ftpstate* fs, int sock)
+{
+    tune_data(fs, sock);
+    if (fs->xfer.unique) {
+        addreply(fs, 0, "FILE: %s", fs->xfer.name); // RFC 1123 4.1.2.9
+    }
+    long rate = fs->xfer.kind == XFER_LIST ? 0 : shape_rate(fs);
+    fs->shaped = rate > 0;
+    if (rate > 0) { // 每步不超过一个桶容量, 使限速平滑
+        size_t burst = (long long)rate * SHAPE_BURST / 1000000;
+        burst = burst < 4096 ? 4096 : burst;
+        fs->xfer.chunk = fs->xfer.chunk < burst ? fs->xfer.chunk : burst;
+        if (!fs->loop && !fs->xfer.uring) { // 阻塞会话限速等待期间由磁盘线程预读或写出
+            xferpipe_start(&fs->xfer);
+        }
+    }
+    fs->xfer.sock = sock;
+    doreply(fs);
+    fs->xfer.started = nowus();
+}
+
+/* 打开数据连接并执行传输; 事件模式下交给事件循环推进 */
+void xfer_run(struct ftpstate* fs)
+{
+    if (fs->loop) {
+        fs->phase = PH_DATA;
+        return;
+    }
+
+    flushreply(fs); // 暂缓的回复 (如 PASV 的端口) 须在等待数据连接前发出
+    int sock = opendata(fs);
+    if (sock < 0) {
+        METRIC_ADD(data_failures, 1);
+        xfer_close(fs);
+        return;
+    }
+    xfer_connected(fs, sock);
+
+    int ret;
+    while ((ret = xfer_step(fs)) > 0) {
+    }
+    xfer_done(fs, ret);
+}
+
+/* 列出目录文件, facts 非零时按 MLSD 格式输出 */
+void dolist(struct ftpstate* fs, char* args, int facts)
+{
+    struct transfer* x = &fs->xfer;
+    char dirname[MAXPATH];
+    int show_list = facts;
+    int show_all = facts;
+
+    while (isspace(*args)) {
+        args++;
+    }
+
+    while (!facts && *args == '-') {
+        while (isalnum(*++args)) {
+            switch (*args) {
+                case 'l':
+                    show_list = 1;
+                    break;
+                case 'a':
+                    show_all = 1;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        while (isspace(*args)) {
+            args++;
+        }
+    }
+
+#ifdef HAVE_INOTIFY
+    /* 以字面路径为键, 命中时不做任何磁盘访问; 只缓存字面路径已是规范路径的目录, 以免符号链接改指向后仍用旧列表 */
+    struct listcache* lc = listcache_of(fs->loop, fs->guest);
+    char lexical[2 * MAXPATH + 2];
+    char key[2 * MAXPATH + 32];
+    if (*args == '\0') {
+        snprintf(lexical, sizeof(lexical), "%s", fs->wd);
+    } else if (*args == '/') {
+        snprintf(lexical, sizeof(lexical), "%s", args);
+    } else {
+        snprintf(lexical, sizeof(lexical), "%s/%s", strcmp(fs->wd, "/") ? fs->wd : "", args);
+    }
+    snprintf(key, sizeof(key), "%d:%d%d%d:%s", fs->uid, show_list, show_all, facts, lexical);
+    struct listentry* hit = lc ? listcache_get(lc, key) : NULL;
+    if (hit) {
+        xfer_begin(fs, XFER_LIST);
+        x->cached = hit;
+        x->total = hit->total;
+        x->method = "list cache";
+        xfer_run(fs);
+        return;
+    }
+#endif
+
+    convert(fs, args, dirname);
+    if (dirname[0] <= ' ') {
+        dirname[0] = '.'; // 默认为当前目录
+        dirname[1] = '\0';
+    }
+
+    DIR* dir = opendir(dirname);
+    if (dir == NULL) {
+        doerror(fs, facts && errno == ENOTDIR ? 501 : 550, dirname);
+        return;
+    }
+
+    char* buf = xferbuf_get(fs->loop);
+    if (!buf) {
+        closedir(dir);
+        doerror(fs, 451, "内存不足");
+        return;
+    }
+
+    xfer_begin(fs, XFER_LIST);
+    x->dir = dir;
+    x->buf = buf;
+    x->show_list = show_list;
+    x->show_all = show_all;
+    x->show_facts = facts;
+    x->uid = fs->uid;
+    x->gid = fs->gid;
+    if (facts) {
+        struct stat st;
+        x->dirwrite = fstat(dirfd(dir), &st) == 0 && modeallows(&st, fs->uid, fs->gid, 3);
+    }
+    strcpy(x->path, dirname);
+#ifdef HAVE_INOTIFY
+    if (lc && strcmp(lexical, dirname) == 0) {
+        x->capture = listcache_begin(lc, key, dirname);
+        x->lc = lc;
+    }
+#endif
+    xfer_run(fs);
+}
+
+/* 在控制连接上列出单个文件的事实 */
+void domlst(struct ftpstate* fs, char* name)
+{
+    char path[MAXPATH];
+    char parent[MAXPATH];
+    struct stat st, pst;
+
+    if (convert(fs, *name ? name : ".", path) < 0 || lstat(path, &st) < 0) {
+        doerror(fs, 550, *name ? name : fs->wd);
+        return;
+    }
+
+    strcpy(parent, path);
+    char* slash = strrchr(parent, '/');
+    if (slash) {
+        slash[slash == parent ? 1 : 0] = '\0';
+    }
+    int dirwrite = strcmp(path, "/") != 0 && stat(parent, &pst) == 0 && modeallows(&pst, fs->uid, fs->gid, 3);
+
+    char line[LINEMAX];
+    factline(&st, NULL, path, fs->uid, fs->gid, dirwrite, line, sizeof(line));
+    addreply(fs, 250, "列出 %s\n %s\n结束", path, line);
+}
+
+/* 取回文件 */
+void doretr(struct ftpstate* fs, char* name)
+{
+    struct transfer* x = &fs->xfer;
+    char filename[MAXPATH];
+    struct stat st;
+
+    if (convert(fs, name, filename) < 0) {
+        char part[MAXPATH + 16];
+        if (partof(name, filename, part, sizeof(part), &st) == 0) {
+            addreply(fs, 450, "%s 的上传尚未完成, 已有 %lld 字节", name, (long long)st.st_size);
+            return;
+        }
+        doerror(fs, 550, name);
+        return;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        doerror(fs, 550, "无法打开 %s", name);
+        return;
+    }
+
+    if (fstat(fd, &st)) {
+        close(fd);
+        doerror(fs, 451, "无法获取文件大小");
+        return;
+    }
+
+    if (fs->restartat && fs->restartat > st.st_size) {
+        close(fd);
+        addreply(fs, 451, "文件偏移位置 %lld 大于文件大小 %lld\n重设偏移为 0",
+                (long long)fs->restartat, (long long)st.st_size);
+        fs->restartat = 0;
+        fs->ranged = 0;
+        return;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        addreply(fs, 450, "非常规文件");
+        return;
+    }
+
+    x->start = fs->restartat;
+    xfer_begin(fs, XFER_RETR);
+    x->fd = fd;
+    x->end = fs->ranged && fs->rangeend < st.st_size ? fs->rangeend + 1 : st.st_size; // 只发送 RANG 指定的部分
+    retr_cache_begin(x, filename, &st);
+    xfer_run(fs);
+}
+
+/* 上传文件, how 为 STOR_* */
+void storfile(struct ftpstate* fs, char* name, int how)
+{
+    struct transfer* x = &fs->xfer;
+    char filename[MAXPATH];
+    char unique[MAXPATH];
+    char part[MAXPATH + 16];
+    struct stat st, pst;
+    int fd;
+
+    if (fs->ranged) {
+        fs->restartat = 0;
+        fs->ranged = 0;
+        addreply(fs, 504, "RANG 只用于下载\n重设偏移为 0");
+        return;
+    }
+
+    off_t start = how == STOR_REPLACE ? fs->restartat : 0;
+    off_t alloc = fs->allocsize; // ALLO 只作用于下一次上传
+    fs->allocsize = 0;
+    if (how == STOR_UNIQUE) { // 依次尝试 名字, 名字.1, 名字.2 ..., 以 O_EXCL 保证不覆盖
+        fd = -1;
+        errno = EEXIST;
+        for (int i = 0; i < 1000 && fd < 0 && errno == EEXIST; i++) {
+            if (i == 0) {
+                snprintf(unique, sizeof(unique), "%s", *name ? name : "ftp");
+            } else {
+                snprintf(unique, sizeof(unique), "%s.%d", *name ? name : "ftp", i);
+            }
+            convert(fs, unique, filename);
+            fd = open(filename, O_CREAT | O_EXCL | O_WRONLY, 0600);
+            if (fd >= 0 && partfile(filename, part, sizeof(part), &pst) == 0) { // 名字留给中断的上传续传
+                close(fd);
+                unlink(filename);
+                fd = -1;
+                errno = EEXIST;
+            }
+        }
+        if (fd < 0) {
+            doerror(fs, 553, "无法创建唯一文件");
+            return;
+        }
+        name = unique;
+    } else {
+        convert(fs, name, filename);
+
+        int revive = 0;
+        if (stat(filename, &st) < 0) {
+            if (errno != ENOENT) {
+                doerror(fs, 553, "无法检测文件状态");
+                return;
+            }
+            st.st_size = 0;
+            // 原名下没有文件时从上次中断留下的部分文件续传
+            if (how == STOR_REPLACE && start > 0 && partof(name, filename, part, sizeof(part), &pst) == 0) {
+                st.st_size = pst.st_size;
+                revive = start <= st.st_size;
+            }
+        }
+        if (start > st.st_size) { // 不留空洞
+            addreply(fs, 451, "文件偏移位置 %lld 大于文件大小 %lld\n重设偏移为 0", (long long)start, (long long)st.st_size);
+            fs->restartat = 0;
+            return;
+        }
+
+        if (revive && rename(part, filename) < 0) {
+            doerror(fs, 553, "无法恢复部分文件");
+            return;
+        }
+
+        // 续传和追加保留已有内容, 只有从头覆盖时截断; 移回的部分文件不跟随符号链接
+        fd = open(filename, O_CREAT | O_WRONLY | (how == STOR_REPLACE && start == 0 ? O_TRUNC : 0) | (revive ? O_NOFOLLOW : 0),
+                0600); // 创建文件要求有权限
+        if (fd < 0) {
+            doerror(fs, 553, "无法打开文件 %s", filename);
+            return;
+        }
+        if (how == STOR_APPEND) {
+            if (fstat(fd, &st) < 0) {
+                close(fd);
+                doerror(fs, 451, "无法获取文件大小");
+                return;
+            }
+            start = st.st_size;
+        }
+    }
+
+    if (start && lseek(fd, start, SEEK_SET) < 0) {
+        close(fd);
+        doerror(fs, 451, "无法设定偏移量");
+        return;
+    }
+
+#ifdef HAVE_FALLOCATE
+    // 一次分配连续的区段; 保持文件大小不变, 使 SIZE 和续传只看到已写出的部分
+    if (alloc > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, start, alloc) < 0 && (errno == ENOSPC || errno == EFBIG)) {
+        close(fd);
+        addreply(fs, 452, "空间不足, 无法预留 %lld 字节", (long long)alloc);
+        return;
+    }
+#endif
+
+    x->start = start;
+    xfer_begin(fs, XFER_STOR);
+    x->unique = how == STOR_UNIQUE;
+    x->append = how == STOR_APPEND;
+    x->prealloc = alloc > 0;
+    x->fd = fd;
+    snprintf(x->name, sizeof(x->name), "%s", name);
+    strcpy(x->path, filename);
+    if (!x->uring) {
+#ifdef HAVE_SPLICE
+        if (pipe2(x->pfd, O_CLOEXEC) == 0) {
+            fcntl(x->pfd[1], F_SETPIPE_SZ, PIPEBUF); // 失败时保持默认容量
+        } else {
+            x->pfd[0] = x->pfd[1] = -1;
+            x->method = "recv/write";
+        }
+#else
+        x->method = "recv/write";
+#endif
+    }
+    xfer_run(fs);
+}
+
+/* 传送文件, 设置了 REST 时从偏移处续写 */
+void dostor(struct ftpstate* fs, char* name)
+{
+    storfile(fs, name, STOR_REPLACE);
+}
+
+/* 追加到文件, 也用于续传中断的上传 */
+void doappe(struct ftpstate* fs, char* name)
+{
+    storfile(fs, name, STOR_APPEND);
+}
+
+/* 以唯一的文件名传送, 参数为名字的前缀 */
+void dostou(struct ftpstate* fs, char* name)
+{
+    storfile(fs, name, STOR_UNIQUE);
+}
+
+/* 文件大小, 中断的上传保留的部分文件也可查询 */
+void dosize(struct ftpstate* fs, char* name)
+{
+    char filename[MAXPATH];
+    struct stat st;
+
+    if (convert(fs, name, filename) < 0 || stat(filename, &st) < 0) {
+        char part[MAXPATH + 16];
+        // 原名下没有文件时报告中断上传已保留的大小, 供 REST+STOR 续传
+        if (partof(name, filename, part, sizeof(part), &st) < 0) {
+            doerror(fs, 550, "%s", name);
+            return;
+        }
+    }
+    if (!S_ISREG(st.st_mode)) {
+        addreply(fs, 550, "%s 不是常规文件", name);
+        return;
+    }
+    addreply(fs, 213, "%lld", (long long)st.st_size);
+}
+
+/* 删除文件 */
+void dodele(struct ftpstate* fs, char* name)
+{
+    char filename[MAXPATH];
+
+    char part[MAXPATH + 16];
+    struct stat st;
+    if (convert(fs, name, filename) < 0) {
+        if (partof(name, filename, part, sizeof(part), &st) == 0 && unlink(part) == 0) { // 放弃未完成的上传
+            addreply(fs, 250, "已删除 '%s' 未完成的上传", name);
+            return;
+        }
+        doerror(fs, 550, name);
+        return;
+    }
+
+    if (unlink(filename) < 0) {
+        addreply(fs, 550, "无法删除 '%s': %s", name, strerror(errno));
+    } else {
+        partname(filename, part, sizeof(part));
+        unlink(part); // 连同中断上传留下的部分文件
+        addreply(fs, 250, "已删除 '%s'", name);
+    }
+}
+
+/* 回应端口 */
+void doport(struct ftpstate* fs, unsigned int ip, unsigned int port)
+{
+    struct sockaddr_in sin;
+
+    if (fs->datasock != -1) {
+        closedata(fs, fs->datasock);
+        fs->datasock = -1;
+    }
+
+    fs->datasock = socket(AF_INET, SOCK_STREAM, 0);
+    if (fs->datasock < 0) {
+        doerror(fs, 425, "无法创建套接字");
+        return;
+    }
+
+    tune_plan(fs, fs->datasock);
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(20); // 数据连接
+    if (bind(fs->datasock, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        doerror(fs, 220, "绑定套接字失败");
+        closedata(fs, fs->datasock);
+        fs->datasock = -1;
+        return;
+    }
+
+    if (fs->debug) {
+        addreply(fs, 0, "数据连接端在 %s:%d", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+    }
+
+    fs->dataport = port;
+
+    if (htonl(ip) != fs->peer.sin_addr.s_addr) {
+        addreply(fs, 425, "不会打开到 %d.%d.%d.%d 的连接 (仅限 %s)",
+                (ip >> 24) & 255, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255,
+                inet_ntoa(fs->peer.sin_addr));
+        closedata(fs, fs->datasock);
+        fs->datasock = -1;
+        return;
+    }
+
+    fs->passive = 0;
+
+    addreply(fs, 200, "PORT 命令完成");
+}
+
+/* 被动模式 */
+void dopasv(struct ftpstate* fs)
+{
+    struct sockaddr_in sin;
+    unsigned int len;
+
+    if (fs->datasock != -1) {
+        closedata(fs, fs->datasock);
+        fs->datasock = -1;
+    }
+
+    len = sizeof(sin);
+    if (getsockname(fs->ctrlsock, (struct sockaddr*)&sin, &len) < 0) {
+        doerror(fs, 425, "无法获取套接字名");
+        return;
+    }
+
+    fs->datasock = socket(AF_INET, SOCK_STREAM, 0);
+    if (fs->datasock < 0) {
+        doerror(fs, 425, "无法打开被动连接");
+        return;
+    }
+
+    sin.sin_port = 0;
+    if (bind(fs->datasock, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        doerror(fs, 425, "无法绑定套接字");
+        return;
+    }
+
+    len = sizeof(sin);
+    if (getsockname(fs->datasock, (struct sockaddr*)&sin, &len) < 0) {
+        doerror(fs, 425, "无法获取套接字名");
+        return;
+    }
+
+    tune_plan(fs, fs->datasock); // 接受的连接继承监听套接字的缓冲区大小
+    listen(fs->datasock, 1);
+    if (fs->nonblock) {
+        fcntl(fs->datasock, F_SETFL, fcntl(fs->datasock, F_GETFL) | O_NONBLOCK);
+    }
+
+    unsigned int a = ntohl(sin.sin_addr.s_addr);
+    unsigned int p = ntohs(sin.sin_port);
+    addreply(fs, 227, "启用被动模式 (%d,%d,%d,%d,%d,%d)", (a >> 24) & 255, (a >> 16) & 255, (a >> 8) & 255, a & 255, (p >> 8) & 255, p & 255);
+
+    fs->passive = 1;
+}
+
+/* 读缓冲区中已完整到达, 尚未执行的命令数 */
+int cmdpending(struct ftpstate* fs)
+{
+    int n = 0;
+    char* end = fs->inbuf + fs->inlen;
+    for (char* p = fs->inbuf + fs->inoff; p < end && (p = memchr(p, '\n', end - p)); p++) {
+        n++;
+    }
+    return n;
+}
+
+/* 命令执行完后是否暂缓发送回复: 后面还有流水线命令且积压不多 */
+int batching(struct ftpstate* fs)
+{
+    return fs->outlen < REPLYBUF && cmdpending(fs) > 0;
+}
+
+/* 从控制连接读取一行命令到 fs->cmd, 返回 1 表示读到, 0 表示需等待更多数据 (非阻塞), -1 表示连接关闭.
+ * 一次 recv 可读入多条命令, 依次取出; 超过 fs->cmd 容量的行整行丢弃并回复 500 */
+int readcmd(struct ftpstate* fs)
+{
+    for (;;) {
+        char* line = fs->inbuf + fs->inoff;
+        size_t avail = fs->inlen - fs->inoff;
+        char* nl = memchr(line, '\n', avail);
+
+        if (fs->inskip) { // 丢弃过长行的剩余部分
+            if (!nl) {
+                fs->inoff = fs->inlen = 0;
+            } else {
+                fs->inoff += nl - line + 1;
+                fs->inskip = 0;
+                addreply(fs, 500, "命令行过长");
+                doreply(fs);
+                continue;
+            }
+        } else if (nl || (fs->ctrleof && avail)) {
+            size_t l = nl ? nl - line + 1 : avail;
+            fs->inoff += l;
+            if (l < sizeof(fs->cmd)) {
+                memcpy(fs->cmd, line, l);
+                fs->cmd[l] = '\0';
+                return 1;
+            }
+            addreply(fs, 500, "命令行过长");
+            doreply(fs);
+            continue;
+        } else if (avail >= sizeof(fs->cmd)) { // 行尾未到已经超长
+            fs->inoff = fs->inlen = 0;
+            fs->inskip = 1;
+        }
+        if (fs->ctrleof) {
+            return -1;
+        }
+
+        if (fs->inoff == fs->inlen) {
+            fs->inoff = fs->inlen = 0;
+        } else if (fs->inlen == sizeof(fs->inbuf)) { // 未完成的行移到开头
+            fs->inlen -= fs->inoff;
+            memmove(fs->inbuf, fs->inbuf + fs->inoff, fs->inlen);
+            fs->inoff = 0;
+        }
+
+        ssize_t n = io_recv(fs, fs->ctrlsock, fs->inbuf + fs->inlen, sizeof(fs->inbuf) - fs->inlen);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (fs->nonblock && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT) {
+                addreply(fs, 421, "超时 (%d 秒)", timedout / 1000);
+            }
+            fs->ctrleof = 1;
+            return -1;
+        }
+        if (n == 0) {
+            fs->ctrleof = 1;
+        }
+        fs->inlen += n;
+    }
+}
+
+/* 站点命令 */
+void dosite(struct ftpstate* fs, char* arg)
+{
+    char* sub = arg;
+    while (*arg && !isspace(*arg)) {
+        *arg = tolower(*arg);
+        arg++;
+    }
+    if (*arg) {
+        *arg++ = '\0';
+    }
+
+    if (strcmp(sub, "names") == 0) { // 名字缓存统计
+        if (!names) {
+            addreply(fs, 200, "未启用名字缓存");
+        } else {
+            addreply(fs, 200, "名字缓存: 命中 %lu, 未命中 %lu",
+                    __atomic_load_n(&names->hits, __ATOMIC_RELAXED), __atomic_load_n(&names->misses, __ATOMIC_RELAXED));
+        }
+#ifdef HAVE_INOTIFY
+    } else if (strcmp(sub, "lists") == 0) { // 目录列表缓存统计
+        struct listcache* lc = listcache_of(fs->loop, fs->guest);
+        if (!lc) {
+            addreply(fs, 200, "未启用目录列表缓存");
+        } else {
+            addreply(fs, 200, "目录列表缓存: 命中 %lu, 未命中 %lu, 占用 %zu/%zu 字节",
+                    lc->hits, lc->misses, lc->bytes, listcachemax);
+        }
+#endif
+    } else if (strcmp(sub, "tune") == 0) { // 最近一次数据连接的调优参数
+        struct tuning* t = &fs->tune;
+        addreply(fs, 200, "数据连接调优:");
+        addreply(fs, 0, " 往返时间 %u 微秒, 偏差 %u 微秒", t->rtt, t->rttvar);
+        addreply(fs, 0, " 带宽时延积 %zu 字节, 每步传输 %zu 字节", t->bdp, t->chunk);
+        addreply(fs, 0, " 缓冲区%s: 发送 %d, 接收 %d", t->fixed ? "已设置" : "由内核自动调整", t->sndbuf, t->rcvbuf);
+        addreply(fs, 0, " TCP_NOTSENT_LOWAT %d", t->lowat);
+        addreply(fs, 0, " 上限: 链路速率 %ld 字节/秒, 缓冲区 %d, 内核自动调整 %d/%d",
+                tunerate, tunemax, autowmem, autormem);
+        addreply(fs, 0, " 上传写后回写窗口 %ld 字节", writebehind);
+        addreply(fs, 0, " 下载大于 %ld 字节的冷文件发送后逐出页缓存, 预读窗口 %d 字节", dropsize, READAHEAD);
+        addreply(fs, 0, " 限速 (字节/秒, 0 为不限): 全局 %ld, 匿名用户 %ld, 登录用户 %ld, 每会话 %ld, 本会话适用 %ld",
+                shaperate[SHAPE_GLOBAL], shaperate[SHAPE_GUEST], shaperate[SHAPE_USER], shaperate[SHAPE_SESSION],
+                shape_rate(fs));
+        addreply(fs, 0, "结束");
+    } else if (strcmp(sub, "xfers") == 0) { // 各类传输的计时直方图, 可指定 retr/stor/list
+        static const char* kinds[] = { NULL, "retr", "stor", "list" };
+        if (!xferstats) {
+            addreply(fs, 200, "未启用传输统计");
+            return;
+        }
+        addreply(fs, 200, "传输统计:");
+        for (int k = XFER_RETR; k <= XFER_LIST; k++) {
+            if (*arg && strcasecmp(arg, kinds[k]) != 0) {
+                continue;
+            }
+            struct xferstat* st = &xferstats[k];
+            addreply(fs, 0, " %s: 字节 %lu, 失败 %lu", kinds[k],
+                    __atomic_load_n(&st->bytes, __ATOMIC_RELAXED), __atomic_load_n(&st->errors, __ATOMIC_RELAXED));
+            struct histogram* hs[] = { &st->ttfb, &st->duration, &st->rate };
+            static const char* names[] = { "首字节(微秒)", "用时(微秒)", "吞吐(字节/秒)" };
+            for (int i = 0; i < 3; i++) {
+                char line[REPLYBUF / 8];
+                unsigned long count = __atomic_load_n(&hs[i]->count, __ATOMIC_RELAXED);
+                int l = snprintf(line, sizeof(line), "  %s 次数 %lu", names[i], count);
+                if (count) {
+                    l += snprintf(line + l, sizeof(line) - l, " 平均 %lu p50<%llu p99<%llu 分桶",
+                            __atomic_load_n(&hs[i]->sum, __ATOMIC_RELAXED) / count,
+                            hist_quantile(hs[i], count, 0.5), hist_quantile(hs[i], count, 0.99));
+                }
+                for (int b = 0; b < HIST_BUCKETS && l < (int)sizeof(line); b++) {
+                    unsigned long n = __atomic_load_n(&hs[i]->buckets[b], __ATOMIC_RELAXED);
+                    if (n) {
+                        l += snprintf(line + l, sizeof(line) - l, " 2^%d:%lu", b, n);
+                    }
+                }
+                addreply(fs, 0, "%s", line);
+            }
+        }
+        addreply(fs, 0, "结束");
+    } else if (strcmp(sub, "log") == 0) { // 查看或调整日志级别: debug, info, error, off
+        static const char* levels[] = { "off", "error", "info", "debug" };
+        static const int values[] = { -1, LOG_ERR, LOG_INFO, LOG_DEBUG };
+        if (*arg) {
+            if (!fs->loggedin || fs->guest || adminuid < 0 || fs->uid != adminuid) { // 影响所有会话, 只限管理用户
+                addreply(fs, 550, "只有管理用户能调整日志级别");
+                return;
+            }
+            int i = 0;
+            while (i < 4 && strcasecmp(arg, levels[i]) != 0) {
+                i++;
+            }
+            if (i == 4) {
+                addreply(fs, 501, "日志级别为 off, error, info 或 debug");
+                return;
+            }
+            if (logring) {
+                __atomic_store_n(&logring->level, values[i], __ATOMIC_RELAXED);
+            } else {
+                loglevel = values[i];
+            }
+        }
+        int level = logring ? __atomic_load_n(&logring->level, __ATOMIC_RELAXED) : loglevel;
+        int i = 0;
+        while (i < 3 && values[i] != level) {
+            i++;
+        }
+        addreply(fs, 200, "日志级别 %s, 丢弃 %lu 条", levels[i],
+                logring ? __atomic_load_n(&logring->dropped, __ATOMIC_RELAXED) : 0UL);
+    } else if (strcmp(sub, "cmds") == 0) { // 各命令的执行次数
+        if (!cmdcounts) {
+            addreply(fs, 200, "未启用命令计数");
+            return;
+        }
+        addreply(fs, 200, "命令计数:");
+        const struct command* c = commands;
+        for (; c->verb; c++) {
+            addreply(fs, 0, " %-4s %lu", c->name, __atomic_load_n(&cmdcounts[c - commands], __ATOMIC_RELAXED));
+        }
+        addreply(fs, 0, " 未知 %lu", __atomic_load_n(&cmdcounts[c - commands], __ATOMIC_RELAXED));
+        addreply(fs, 0, "结束");
+    } else {
+        addreply(fs, 200, "没什么可做的");
+    }
+}
+
+/* 帮助: 带参数时给出单个命令的用法, 否则列出全部命令 */
+void dohelp(struct ftpstate* fs, char* arg)
+{
+    for (const struct command* c = commands; arg && *arg && c->verb; c++) {
+        if (strcasecmp(arg, c->name) == 0) {
+            addreply(fs, 214, "用法: %s", c->help);
+            return;
+        }
+    }
+
+    addreply(fs, 214, "支持的命令:");
+    for (const struct command* c = commands; c->verb; c++) {
+        addreply(fs, 0, " %s", c->help);
+    }
+    addreply(fs, 0, "结束");
+}
+
+/* 列出扩展功能 */
+void dofeat(struct ftpstate* fs, char* arg)
+{
+    addreply(fs, 211, "扩展功能:");
+    for (const struct command* c = commands; c->verb; c++) {
+        if (c->feat) {
+            addreply(fs, 0, " %s", c->feat);
+        }
+    }
+    addreply(fs, 0, "结束");
+}
+
+void doquit(struct ftpstate* fs, char* arg)
+{
+    addreply(fs, 221, "再见");
+}
+
+void doacct(struct ftpstate* fs, char* arg)
+{
+    addreply(fs, 500, "不支持账户认证");
+}
+
+/* 认得但未实现的命令, 留在命令表和 HELP 中以便客户端区分于未知命令 */
+void donotimpl(struct ftpstate* fs, char* arg)
+{
+    addreply(fs, 502, "命令未实现");
+}
+
+void donoop(struct ftpstate* fs, char* arg)
+{
+    addreply(fs, 200, "冒个泡");
+}
+
+void dosyst(struct ftpstate* fs, char* arg)
+{
+    struct utsname unameData;
+    if (uname(&unameData) == 0) {
+        addreply(fs, 215, "%s", unameData.sysname);
+    }
+}
+
+void doportcmd(struct ftpstate* fs, char* arg)
+{
+    unsigned int a1, a2, a3, a4, p1, p2;
+    if (sscanf(arg, "%u,%u,%u,%u,%u,%u", &a1, &a2, &a3, &a4, &p1, &p2) == 6
+            && a1 < 256 && a2 < 256 && a3 < 256 && a4 < 256 && p1 < 256 && p2 < 256) {
+        doport(fs, (a1 << 24) + (a2 << 16) + (a3 << 8) + a4, ((p1 << 8) + p2));
+    } else {
+        addreply(fs, 501, "语法错误");
+    }
+}
+
+void dopasvcmd(struct ftpstate* fs, char* arg)
+{
+    dopasv(fs);
+}
+
+/* 解析非负的 64 位偏移, 成功时返回 0 */
+int parseoff(char* arg, off_t* off, char** endp)
+{
+    char* end;
+
+    while (isspace(*arg)) {
+        arg++;
+    }
+    errno = 0;
+    long long v = strtoll(arg, &end, 10);
+    if (end == arg || !isdigit(*arg) || errno == ERANGE || v < 0) {
+        return -1;
+    }
+    *off = v;
+    *endp = end;
+    return 0;
+}
+
+void dorest(struct ftpstate* fs, char* arg)
+{
+    off_t off;
+    char* end;
+
+    if (parseoff(arg, &off, &end) < 0 || *end) {
+        addreply(fs, 501, "无效的偏移 %s", arg);
+        return;
+    }
+    fs->restartat = off;
+    fs->ranged = 0;
+    addreply(fs, 350, "从 %lld 处重新开始, 发送 RETR 或 STOR 开始传送", (long long)off);
+}
+
+/* 范围下载 (draft-bryan-ftp-range): RANG 起点 终点, 终点含在内; RANG 1 0 取消 */
+void dorang(struct ftpstate* fs, char* arg)
+{
+    off_t start, last;
+    char* end;
+
+    if (parseoff(arg, &start, &end) < 0 || !isspace(*end) || parseoff(end, &last, &end) < 0 || *end) {
+        addreply(fs, 501, "语法错误, 应为 RANG <起点> <终点>");
+        return;
+    }
+    if (start == 1 && last == 0) {
+        fs->restartat = 0;
+        fs->ranged = 0;
+        addreply(fs, 350, "已取消范围");
+        return;
+    }
+    if (last < start) {
+        addreply(fs, 501, "终点 %lld 小于起点 %lld", (long long)last, (long long)start);
+        return;
+    }
+    fs->restartat = start;
+    fs->rangeend = last;
+    fs->ranged = 1;
+    addreply(fs, 350, "从 %lld 处开始, 到 %lld 处结束", (long long)start, (long long)last);
+}
+
+/* 为下一次上传预留空间: ALLO <字节数> [R <记录长度>], 记录长度不适用于流模式, 忽略 */
+void doallo(struct ftpstate* fs, char* arg)
+{
+    off_t size;
+    char* end;
+
+    if (parseoff(arg, &size, &end) < 0) {
+        addreply(fs, 501, "无效的大小 %s", arg);
+        return;
+    }
+#ifdef HAVE_FALLOCATE
+    fs->allocsize = size;
+    addreply(fs, 200, "将为下一次上传预留 %lld 字节", (long long)size);
+#else
+    addreply(fs, 202, "无需预留空间");
+#endif
+}
+
+void docdup(struct ftpstate* fs, char* arg)
+{
+    docwd(fs, "..");
+}
+
+void dosmnt(struct ftpstate* fs, char* arg)
+{
+    addreply(fs, 200, "不支持挂载结构");
+}
+
+void dorein(struct ftpstate* fs, char* arg)
+{
+    fs->loggedin = 0;
+    fs->uid = -1;
+    addreply(fs, 220, "服务已为新用户准备好");
+}
+
+void dotype(struct ftpstate* fs, char* arg)
+{
+    if (tolower(*arg) == 'i') { // Image
+        addreply(fs, 200, "二进制类型文件");
+    } else {
+        addreply(fs, 504, "只支持二进制类型文件");
+    }
+}
+
+void dostru(struct ftpstate* fs, char* arg)
+{
+    if (tolower(*arg) == 'f') { // File
+        addreply(fs, 200, "文件结构");
+    } else {
+        addreply(fs, 504, "只支持文件结构");
+    }
+}
+
+void domode(struct ftpstate* fs, char* arg)
+{
+    if (tolower(*arg) == 's') { // Stream
+        addreply(fs, 200, "流模式");
+    } else {
+        addreply(fs, 504, "只支持流模式");
+    }
+}
+
+void doabor(struct ftpstate* fs, char* arg)
+{
+    addreply(fs, 226, "中止");
+}
+
+void dopwd(struct ftpstate* fs, char* arg)
+{
+    addreply(fs, 257, "\"%s\"", fs->wd);
+}
+
+void dolistcmd(struct ftpstate* fs, char* arg)
+{
+    dolist(fs, *arg ? arg : "-l", 0);
+}
+
+void donlst(struct ftpstate* fs, char* arg)
+{
+    dolist(fs, arg, 0);
+}
+
+void domlsd(struct ftpstate* fs, char* arg)
+{
+    dolist(fs, arg, 1);
+}
+
+/* 命令表, 常用的命令在前 */
+const struct command commands[] = {
+    { VERB('r', 'e', 't', 'r'), "retr", doretr, CMD_LOGIN | CMD_ARG, "文件名", "retr <pathname>", NULL },
+    { VERB('s', 't', 'o', 'r'), "stor", dostor, CMD_LOGIN | CMD_ARG, "文件名", "stor <pathname>", NULL },
+    { VERB('a', 'p', 'p', 'e'), "appe", doappe, CMD_LOGIN | CMD_ARG, "文件名", "appe <pathname>", NULL },
+    { VERB('s', 't', 'o', 'u'), "stou", dostou, CMD_LOGIN, NULL, "stou [<prefix>]", NULL },
+    { VERB('a', 'l', 'l', 'o'), "allo", doallo, CMD_LOGIN | CMD_ARG, "大小", "allo <decimal-integer>", NULL },
+    { VERB('s', 'i', 'z', 'e'), "size", dosize, CMD_LOGIN | CMD_ARG, "文件名", "size <pathname>", "SIZE" },
+    { VERB('r', 'e', 's', 't'), "rest", dorest, CMD_LOGIN | CMD_ARG, "偏移", "rest <marker>", "REST STREAM" },
+    { VERB('r', 'a', 'n', 'g'), "rang", dorang, CMD_LOGIN | CMD_ARG, "范围", "rang <start> <end>", "RANG STREAM" },
+    { VERB('p', 'a', 's', 'v'), "pasv", dopasvcmd, 0, NULL, "pasv", NULL },
+    { VERB('p', 'o', 'r', 't'), "port", doportcmd, 0, NULL, "port <host-port>", NULL },
+    { VERB('l', 'i', 's', 't'), "list", dolistcmd, CMD_LOGIN, NULL, "list [<pathname>]", NULL },
+    { VERB('n', 'l', 's', 't'), "nlst", donlst, CMD_LOGIN, NULL, "nlst [<pathname>]", NULL },
+    { VERB('m', 'l', 's', 'd'), "mlsd", domlsd, CMD_LOGIN, NULL, "mlsd [<pathname>]", NULL },
+    { VERB('m', 'l', 's', 't'), "mlst", domlst, CMD_LOGIN, NULL, "mlst [<pathname>]",
+        "MLST type*;size*;modify*;perm*;unique*;" },
+    { VERB('c', 'w', 'd', 0), "cwd", docwd, CMD_LOGIN, NULL, "cwd  <pathname>", NULL },
+    { VERB('c', 'd', 'u', 'p'), "cdup", docdup, CMD_LOGIN, NULL, "cdup", NULL },
+    { VERB('p', 'w', 'd', 0), "pwd", dopwd, CMD_LOGIN, NULL, "pwd", NULL },
+    { VERB('t', 'y', 'p', 'e'), "type", dotype, CMD_LOGIN | CMD_ARG, "类型", "type <type-code>", NULL },
+    { VERB('n', 'o', 'o', 'p'), "noop", donoop, 0, NULL, "noop", NULL },
+    { VERB('u', 's', 'e', 'r'), "user", douser, 0, NULL, "user <username>", NULL },
+    { VERB('p', 'a', 's', 's'), "pass", dopass, 0, NULL, "pass <password>", NULL },
+    { VERB('q', 'u', 'i', 't'), "quit", doquit, CMD_EXIT, NULL, "quit", NULL },
+    { VERB('d', 'e', 'l', 'e'), "dele", dodele, CMD_LOGIN | CMD_ARG, "文件名", "dele <pathname>", NULL },
+    { VERB('r', 'n', 'f', 'r'), "rnfr", donotimpl, CMD_LOGIN, NULL, "rnfr <pathname>", NULL },
+    { VERB('r', 'n', 't', 'o'), "rnto", donotimpl, CMD_LOGIN, NULL, "rnto <pathname>", NULL },
+    { VERB('m', 'k', 'd', 0), "mkd", domkd, CMD_LOGIN | CMD_ARG, "目录名", "mkd  <pathname>", NULL },
+    { VERB('r', 'm', 'd', 0), "rmd", dormd, CMD_LOGIN | CMD_ARG, "目录名", "rmd  <pathname>", NULL },
+    { VERB('s', 't', 'r', 'u'), "stru", dostru, CMD_LOGIN | CMD_ARG, "结构", "stru <structure-code>", NULL },
+    { VERB('m', 'o', 'd', 'e'), "mode", domode, CMD_LOGIN | CMD_ARG, "模式", "mode <mode-code>", NULL },
+    { VERB('a', 'b', 'o', 'r'), "abor", doabor, CMD_LOGIN, NULL, "abor", NULL },
+    { VERB('s', 'y', 's', 't'), "syst", dosyst, 0, NULL, "syst", NULL },
+    { VERB('s', 't', 'a', 't'), "stat", donotimpl, 0, NULL, "stat [<pathname>]", NULL },
+    { VERB('f', 'e', 'a', 't'), "feat", dofeat, 0, NULL, "feat", NULL },
+    { VERB('h', 'e', 'l', 'p'), "help", dohelp, 0, NULL, "help [<string>]", NULL },
+    { VERB('s', 'i', 't', 'e'), "site", dosite, CMD_LOGIN, NULL, "site <string>", NULL },
+    { VERB('s', 'm', 'n', 't'), "smnt", dosmnt, CMD_LOGIN, NULL, "smnt <pathname>", NULL },
+    { VERB('r', 'e', 'i', 'n'), "rein", dorein, CMD_LOGIN, NULL, "rein", NULL },
+    { VERB('a', 'c', 'c', 't'), "acct", doacct, 0, NULL, "acct <account-information>", NULL },
+    { 0 }
+};
+
+/* 映射命令计数 */
+void cmdcounts_init(void)
+{
+    size_t n = 1;
+    for (const struct command* c = commands; c->verb; c++) {
+        n++;
+    }
+    void* p = mmap(NULL, n * sizeof(unsigned long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        pe("映射命令计数失败, 不计数: %m");
+        return;
+    }
+    cmdcounts = p;
+}
+
+/* 按打包的命令名查表, 找不到时返回结束项 */
+const struct command* cmdlookup(const char* cmd)
+{
+    uint32_t verb = 0;
+    for (int i = 0; cmd[i]; i++) {
+        if (i == 4) { // 过长的命令名按未知命令处理
+            verb = 0;
+            break;
+        }
+        verb |= (uint32_t)(unsigned char)cmd[i] << (i * 8);
+    }
+
+    const struct command* c = commands;
+    while (c->verb && c->verb != verb) {
+        c++;
+    }
+    return c;
+}
+
+/* 执行命令 */
+int docmd(struct ftpstate* fs)
+{
+    char* arg;
+    char* cmd;
+    unsigned long cmdsize;
+    int n = 0;
+
+    cmd = fs->cmd;
+    cmdsize = strlen(cmd);
+
+    if (fs->debug) {
+        addreply(fs, 0, "%s", cmd);
+    }
+
+    n = 0;
+    while (isalpha(cmd[n]) && n < cmdsize) {
+        cmd[n] = tolower(cmd[n]);
+        n++;
+    }
+
+    if (!n) {
+        addreply(fs, 221, "再见");
+        return 0;
+    }
+
+    while (isspace(cmd[n]) && n < cmdsize) {
+        cmd[n++] = '\0';
+    }
+    arg = cmd + n;
+
+    while (cmd[n] && n < cmdsize) {
+        n++;
+    }
+    n--;
+
+    while (isspace(cmd[n])) {
+        cmd[n--] = '\0';
+    }
+
+    p("命令 [%s %s]", cmd, strcmp(cmd, "pass") == 0 && *arg ? "******" : arg); // 不记录口令
+    const struct command* c = cmdlookup(cmd);
+    if (cmdcounts) {
+        __atomic_fetch_add(&cmdcounts[c - commands], 1, __ATOMIC_RELAXED);
+    }
+    if (!c->verb) {
+        addreply(fs, 500, "未知命令");
+        return 1;
+    }
+
+    if (c->flags & CMD_LOGIN) {
+        douser(fs, NULL);
+        if (!fs->loggedin) {
+            return 1;
+        }
+    }
+    if ((c->flags & CMD_ARG) && !*arg) {
+        addreply(fs, 501, "缺少%s", c->argname);
+        return 1;
+    }
+
+    c->fn(fs, arg);
+    return c->flags & CMD_EXIT ? 0 : 1;
+}
+
+/* 映射地址计数表, 未设置任何上限时不需要 */
+void iplimit_init(void)
+{
+    if (iplimitmax <= 0 && nipquotas == 0) {
+        return;
+    }
+    void* p = mmap(NULL, sizeof(struct iplimit), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        pe("映射地址计数表失败, 不限制单个地址的会话数: %m");
+        return;
+    }
+    iplimits = p;
+}
+
+/* 地址适用的会话上限, 后设置的地址段优先, 都不匹配时为全局上限 */
+int iplimit_of(in_addr_t addr)
+{
+    for (int i = nipquotas - 1; i >= 0; i--) {
+        if ((addr & ipquotas[i].mask) == ipquotas[i].net) {
+            return ipquotas[i].limit;
+        }
+    }
+    return iplimitmax;
+}
+
+/* 在工作进程中时记下本进程在槽中计入的数; 槽中的数不小于各工作进程记下的数之和, 故不会被其他地址回收 */
+void iplimit_own(unsigned long long* slot, int n)
+{
+    if (workerips && workerid >= 0) {
+        __atomic_fetch_add(&workerips[workerid * IPLIMIT_SLOTS + (slot - iplimits->slots)], n, __ATOMIC_RELAXED);
+    }
+}
+
+/* 接纳来自 addr 的连接: 超出上限返回 -1, 已计数返回 1, 不限或相邻槽都被占用而不计数时返回 0 */
+int iplimit_admit(in_addr_t addr)
+{
+    int limit = iplimit_of(addr);
+    if (!iplimits || limit <= 0) {
+        return 0;
+    }
+
+    unsigned int h = namecache_hash(0, addr, NULL);
+    for (int tries = 0; tries < 4; tries++) {
+        unsigned long long* spare = NULL;
+        unsigned long long seen = 0;
+        for (int i = 0; i < IPLIMIT_PROBES; i++) {
+            unsigned long long* slot = &iplimits->slots[(h + i) % IPLIMIT_SLOTS];
+            unsigned long long v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+            while ((in_addr_t)(v >> 32) == addr) { // CAS 失败时 v 为新值, 槽可能已被回收
+                if ((v & 0xffffffff) >= (unsigned int)limit) {
+                    return -1;
+                }
+                if (__atomic_compare_exchange_n(slot, &v, v + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    iplimit_own(slot, 1);
+                    return 1;
+                }
+            }
+            if ((v & 0xffffffff) == 0 && !spare) {
+                spare = slot;
+                seen = v;
+            }
+        }
+        if (!spare) {
+            return 0;
+        }
+        // 同时为同一新地址占槽的进程会选中同一个槽, 失败的一方重新查找时计入胜者的槽
+        if (__atomic_compare_exchange_n(spare, &seen, (unsigned long long)addr << 32 | 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            iplimit_own(spare, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* 会话结束, 扣除 iplimit_admit 计入的数 */
+void iplimit_release(in_addr_t addr)
+{
+    unsigned int h = namecache_hash(0, addr, NULL);
+    for (int i = 0; i < IPLIMIT_PROBES; i++) {
+        unsigned long long* slot = &iplimits->slots[(h + i) % IPLIMIT_SLOTS];
+        unsigned long long v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        while ((in_addr_t)(v >> 32) == addr && (v & 0xffffffff) > 0) {
+            if (__atomic_compare_exchange_n(slot, &v, v - 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                iplimit_own(slot, -1);
+                return;
+            }
+        }
+    }
+}
+
+/* 工作进程异常退出, 它名下的会话不再有谁扣除: 由管理进程按它记下的数从各槽扣除 */
+void iplimit_sweep(int id)
+{
+    unsigned int* held = &workerips[id * IPLIMIT_SLOTS];
+    for (int i = 0; i < IPLIMIT_SLOTS; i++) {
+        unsigned int n = __atomic_exchange_n(&held[i], 0, __ATOMIC_RELAXED);
+        unsigned long long* slot = &iplimits->slots[i];
+        unsigned long long v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        while (n > 0 && (v & 0xffffffff) > 0) {
+            unsigned int d = (v & 0xffffffff) < n ? (v & 0xffffffff) : n;
+            if (__atomic_compare_exchange_n(slot, &v, v - d, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+    }
+}
+
+/* 不建立会话, 直接回复并关闭连接 */
+void refuse(int fd, int code, const char* msg)
+{
+    char line[LINEMAX];
+    int n = snprintf(line, sizeof(line), "%d %s\r\n", code, msg);
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    send(fd, line, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+/* 拒绝一个连接并按原因计数 */
+void shed(int fd, int reason)
+{
+    static const char* msgs[SHED_REASONS] = {
+        "来自该地址的连接过多", "会话已满, 请稍后再试", "服务器繁忙, 请稍后再试", "服务器资源不足, 请稍后再试",
+        "服务器资源不足, 请稍后再试",
+    };
+    METRIC_ADD(rejected[reason], 1);
+    refuse(fd, 421, msgs[reason]);
+}
+
+long loadcenti;     // 最近读到的一分钟平均负载 (百分之一)
+time_t loadchecked; // 读取负载的时刻
+
+/* 是否过载: 所有进程合计的会话数或系统负载超出上限时返回拒绝原因, 否则返回 -1; 负载每秒最多读一次 */
+int overload(void)
+{
+    if (sessionmax > 0 && metrics && __atomic_load_n(&metrics->sessions, __ATOMIC_RELAXED) >= sessionmax) {
+        return SHED_SESSIONS;
+    }
+    if (loadmax > 0) {
+        time_t now = time(NULL);
+        if (__atomic_load_n(&loadchecked, __ATOMIC_RELAXED) != now) {
+            double load;
+            __atomic_store_n(&loadchecked, now, __ATOMIC_RELAXED);
+            if (getloadavg(&load, 1) == 1) {
+                __atomic_store_n(&loadcenti, (long)(load * 100), __ATOMIC_RELAXED);
+            }
+        }
+        if (__atomic_load_n(&loadcenti, __ATOMIC_RELAXED) > loadmax * 100) {
+            return SHED_LOAD;
+        }
+    }
+    return -1;
+}
+
+/* 接受一个连接, 新描述符设置 close-on-exec, nonblock 非 0 时设为非阻塞. 没有 accept4 的平台接受后再用 fcntl 设置 */
+int acceptfd(int listen_fd, struct sockaddr_in* client, int nonblock)
+{
+    socklen_t len = sizeof(*client);
+#ifdef HAVE_ACCEPT4
+    return accept4(listen_fd, (struct sockaddr*)client, &len, SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0));
+#else
+    int fd = accept(listen_fd, (struct sockaddr*)client, &len);
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (nonblock) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+    return fd;
+#endif
+}
+
+/* 接受连接. 描述符耗尽时放开预留的描述符接受一个连接并回复 421, 使积压的连接尽快得到答复而不是空等,
+ * 此时返回 -1 且 errno 为 ECONNABORTED; 连预留的描述符也没有时 errno 为 EMFILE 或 ENFILE */
+int acceptconn(int listen_fd, struct sockaddr_in* client, int nonblock, int* reserve)
+{
+    if (*reserve < 0) {
+        *reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    int fd = acceptfd(listen_fd, client, nonblock);
+    if (fd >= 0 || (errno != EMFILE && errno != ENFILE) || *reserve < 0) {
+        return fd;
+    }
+
+    int err = errno;
+    close(*reserve);
+    fd = acceptfd(listen_fd, client, 0);
+    if (fd >= 0) {
+        shed(fd, SHED_FDS);
+        err = ECONNABORTED;
+    }
+    *reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    errno = err;
+    return -1;
+}
+
+/* 初始化会话 */
+void session_init(struct ftpstate* fs, int fd)
+{
+    bzero(fs, sizeof(*fs));
+    fs->ctrlsock = fd;
+    fs->datasock = -1;
+    fs->uid = -1;
+    fs->evdatafd = -1;
+    fs->xfer.fd = fs->xfer.sock = -1;
+    fs->xfer.pfd[0] = fs->xfer.pfd[1] = -1;
+
+    socklen_t len = sizeof(fs->peer);
+    getpeername(fd, (struct sockaddr*)&fs->peer, &len);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // 回复已整条发出, 无需等待合并
+
+    addreply(fs, 220, "欢迎");
+}
+
+/* 释放会话占用的资源 */
+void session_free(struct ftpstate* fs)
+{
+    if (fs->loop) { // 可能由超时清理调用, 以本会话的身份保留部分文件
+        setident(fs, fs->loggedin);
+        fs->loop->ident = NULL;
+    }
+    if (fs->xfer.kind == XFER_STOR && fs->xfer.fd >= 0) { // 会话在上传中途结束
+        xferpipe_end(&fs->xfer);
+        stor_keep(fs, 426);
+    }
+    xfer_close(fs);
+    if (fs->renamefrom) {
+        free(fs->renamefrom);
+    }
+    if (fs->datasock != -1) {
+        closedata(fs, fs->datasock);
+    }
+    free(fs->outbuf);
+    close(fs->ctrlsock);
+    if (fs->admitted) {
+        iplimit_release(fs->peer.sin_addr.s_addr);
+    }
+}
+
+/* 会话数变化, 由建立会话的一方 (fork 模式的父进程, 事件循环) 计入, 会话进程被信号杀死也不会漏减;
+ * 在工作进程中时同时计入本进程的份额, 以便工作进程异常退出时由管理进程一并扣除 */
+void sessions_add(long n)
+{
+    METRIC_ADD(sessions, n);
+    if (n > 0) {
+        METRIC_ADD(sessions_total, n);
+    }
+    if (workersessions && workerid >= 0) {
+        __atomic_fetch_add(&workersessions[workerid], n, __ATOMIC_RELAXED);
+    }
+}
+
+/* FTP 服务器进程 */
+void ftp_task(int fd)
+{
+    // p("新服务器进程！");
+
+    struct ftpstate state;
+
+    session_init(&state, fd);
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timedout, sizeof(timedout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timedout, sizeof(timedout));
+
+    for (;;) {
+        if (batching(&state)) {
+            holdreply(&state);
+        } else {
+            doreply(&state);
+        }
+        // p("正在执行命令...");
+        if (readcmd(&state) <= 0 || docmd(&state) <= 0) {
+            break;
+        }
+        // p("执行命令");
+    }
+    doreply(&state);
+
+    session_free(&state);
+}
+
+#ifdef HAVE_EPOLL
+/* 按会话阶段更新 epoll 中登记的事件 */
+void session_arm(struct ftpstate* fs)
+{
+    struct epoll_event ev;
+    int epfd = fs->loop->epfd;
+
+    int want = 0;
+    if (fs->phase == PH_CMD && !fs->ctrleof) {
+        want |= EPOLLIN;
+    }
+    if (fs->outoff < fs->outlen) {
+        want |= EPOLLOUT;
+    }
+    if (want != fs->evctrl) {
+        ev.events = want;
+        ev.data.ptr = fs;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fs->ctrlsock, &ev);
+        fs->evctrl = want;
+    }
+
+    int fd = -1;
+    want = 0;
+    if (fs->phase == PH_DATA) {
+        fd = fs->datasock;
+        want = fs->passive ? EPOLLIN : EPOLLOUT;
+    } else if (fs->phase == PH_XFER) {
+        fd = fs->xfer.sock;
+        want = fs->xfer.resume ? 0 : fs->xfer.kind == XFER_STOR ? EPOLLIN : EPOLLOUT; // 限速暂停时不关心数据连接
+    }
+
+    ev.events = want;
+    ev.data.ptr = (void*)((uintptr_t)fs | 1); // 最低位标记数据连接
+    if (fd != fs->evdatafd) {
+        if (fs->evdatafd >= 0) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fs->evdatafd, NULL);
+        }
+        if (fd >= 0) {
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+    } else if (fd >= 0 && want != fs->evdata) {
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    fs->evdatafd = fd;
+    fs->evdata = want;
+}
+
+/* 暂停或恢复接受新连接 */
+void evloop_pause(struct evloop* loop, int pause)
+{
+    if (pause == loop->paused) {
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(loop->epfd, pause ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, loop->listen_fd, &ev);
+    loop->paused = pause;
+}
+
+/* 关闭会话并从事件循环中移除 */
+void session_close(struct ftpstate* fs)
+{
+    struct evloop* loop = fs->loop;
+
+    if (fs->prev) {
+        fs->prev->next = fs->next;
+    } else {
+        loop->sessions = fs->next;
+    }
+    if (fs->next) {
+        fs->next->prev = fs->prev;
+    }
+    loop->nsessions--;
+    sessions_add(-1);
+    if (maxsessions == 0 || loop->nsessions < maxsessions) {
+        evloop_pause(loop, 0);
+    }
+
+    session_free(fs);
+    fs->phase = PH_DEAD;
+    fs->next = loop->dead;
+    loop->dead = fs;
+}
+
+/* 推进会话的状态机, 直到需要等待 I/O */
+void session_run(struct ftpstate* fs)
+{
+    setident(fs, fs->loggedin); // 所有会话共用进程, 以会话用户的身份访问文件
+    fs->lastactive = time(NULL);
+
+    for (int steps = 0; steps < 64; steps++) { // 限制每次推进的步数, 保证会话间公平
+        if (fs->outoff < fs->outlen && !(fs->phase == PH_CMD && batching(fs)) && flushreply(fs) == 0) {
+            break;
+        }
+
+        if (fs->phase == PH_DATA) {
+            if (fs->ctrleof) {
+                session_close(fs);
+                return;
+            }
+            int sock = opendata(fs);
+            if (sock == -2) {
+                break;
+            }
+            if (sock < 0) {
+                METRIC_ADD(data_failures, 1);
+                xfer_close(fs);
+                fs->phase = PH_CMD;
+                doreply(fs);
+                continue;
+            }
+            xfer_connected(fs, sock);
+            fs->phase = PH_XFER;
+        } else if (fs->phase == PH_XFER) {
+            if (fs->ctrleof) {
+                session_close(fs);
+                return;
+            }
+            if (fs->xfer.resume) { // 限速暂停中
+                if (nowus() < fs->xfer.resume) {
+                    break;
+                }
+                fs->xfer.resume = 0;
+            }
+            int ret = xfer_step(fs);
+            if (ret > 0) {
+                continue;
+            }
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            xfer_done(fs, ret);
+            fs->phase = PH_CMD;
+            doreply(fs);
+        } else if (fs->phase == PH_CMD) {
+            int ret = readcmd(fs);
+            if (ret == 0) {
+                break;
+            }
+            if (ret < 0 || docmd(fs) <= 0) {
+                fs->phase = PH_QUIT;
+            }
+            if (fs->phase == PH_CMD && batching(fs)) {
+                holdreply(fs);
+            } else {
+                doreply(fs);
+            }
+        } else { // PH_QUIT
+            if (fs->outoff < fs->outlen) {
+                break;
+            }
+            session_close(fs);
+            return;
+        }
+    }
+
+    session_arm(fs);
+}
+
+/* 接受新的控制连接 */
+void evloop_accept(struct evloop* loop)
+{
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        if (maxsessions > 0 && loop->nsessions >= maxsessions) {
+            evloop_pause(loop, 1);
+            return;
+        }
+
+        struct sockaddr_in client;
+        int fd = acceptconn(loop->listen_fd, &client, 1, &loop->reservefd);
+        if (fd < 0) {
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) { // 无法答复积压的连接, 暂停接受直到有会话结束或下次清理
+                pe("描述符耗尽, 暂停接受连接");
+                evloop_pause(loop, 1);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                pe("接收连接失败: %m");
+            }
+            return;
+        }
+
+        int reason = overload();
+        if (reason >= 0) {
+            shed(fd, reason);
+            continue;
+        }
+
+        char addr[INET_ADDRSTRLEN];
+        pp("客户端请求 %s:%d", inet_ntop(AF_INET, &client.sin_addr, addr, sizeof(addr)), ntohs(client.sin_port));
+
+        int admit = iplimit_admit(client.sin_addr.s_addr);
+        if (admit < 0) {
+            pp("来自 %s 的会话过多, 拒绝连接", addr);
+            shed(fd, SHED_IP);
+            continue;
+        }
+
+        struct ftpstate* fs = malloc(sizeof(struct ftpstate));
+        if (!fs) {
+            if (admit > 0) {
+                iplimit_release(client.sin_addr.s_addr);
+            }
+            shed(fd, SHED_RESOURCE);
+            continue;
+        }
+        session_init(fs, fd);
+        fs->admitted = admit > 0;
+        fs->nonblock = 1;
+        fs->loop = loop;
+        fs->lastactive = time(NULL);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = fs;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            session_free(fs);
+            free(fs);
+            continue;
+        }
+        fs->evctrl = EPOLLIN;
+
+        fs->next = loop->sessions;
+        if (loop->sessions) {
+            loop->sessions->prev = fs;
+        }
+        loop->sessions = fs;
+        loop->nsessions++;
+        sessions_add(1);
+
+        doreply(fs);
+        session_arm(fs);
+    }
+}
+
+/* 关闭空闲超时的会话 */
+void evloop_sweep(struct evloop* loop)
+{
+    if (maxsessions == 0 || loop->nsessions < maxsessions) { // 因描述符耗尽的暂停每秒重试
+        evloop_pause(loop, 0);
+    }
+
+    time_t now = time(NULL);
+    struct ftpstate* fs = loop->sessions;
+    while (fs) {
+        struct ftpstate* next = fs->next;
+        if (fs->phase != PH_XFER && now - fs->lastactive > timedout / 1000) {
+            addreply(fs, 421, "超时 (%d 秒)", timedout / 1000);
+            doreply(fs);
+            session_close(fs);
+        }
+        fs = next;
+    }
+}
+
+/* 唤醒限速暂停已到期的会话, 返回距下一个到期的毫秒数, 没有暂停的会话时为 -1 */
+int evloop_resume(struct evloop* loop)
+{
+    long long now = nowus();
+    long long next = 0;
+
+    struct ftpstate* fs = loop->sessions;
+    while (fs) {
+        struct ftpstate* nextfs = fs->next;
+        if (fs->phase == PH_XFER && fs->xfer.resume && fs->xfer.resume <= now) {
+            session_run(fs);
+        }
+        if (fs->phase == PH_XFER && fs->xfer.resume && (!next || fs->xfer.resume < next)) {
+            next = fs->xfer.resume;
+        }
+        fs = nextfs;
+    }
+
+    loop->throttled = next != 0;
+    if (!next) {
+        return -1;
+    }
+    now = nowus();
+    return next > now ? (next - now + 999) / 1000 : 0;
+}
+
+/* 单进程事件循环, 同时服务所有会话 */
+void evloop_run(int listen_fd)
+{
+    struct evloop loop;
+    struct epoll_event events[256];
+
+    bzero(&loop, sizeof(loop));
+    loop.listen_fd = listen_fd;
+    loop.lc.ifd = -1;
+    loop.reservefd = -1;
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+        pe("创建 epoll 失败: %m");
+        exit(-1);
+    }
+
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    time_t swept = time(NULL);
+    for (;;) {
+        int timeout = 1000;
+        if (loop.throttled) {
+            int wait = evloop_resume(&loop);
+            timeout = wait >= 0 && wait < timeout ? wait : timeout;
+        }
+        int n = epoll_wait(loop.epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+        if (n < 0 && errno != EINTR) {
+            pe("epoll_wait 失败: %m");
+            exit(-1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            uintptr_t tag = (uintptr_t)events[i].data.ptr;
+            struct ftpstate* fs = (struct ftpstate*)(tag & ~(uintptr_t)1);
+            int isdata = tag & 1;
+            if (fs == NULL) {
+                evloop_accept(&loop);
+                continue;
+            }
+
+            // 同一会话的多个描述符可能在本轮都就绪, 会话已关闭时跳过
+            if (fs->phase == PH_DEAD) {
+                continue;
+            }
+            // 传输期间控制连接不读, 但对端关闭时需要知道
+            if (!isdata && fs->phase != PH_CMD && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                fs->ctrleof = 1;
+            }
+            session_run(fs);
+        }
+
+        while (loop.dead) {
+            struct ftpstate* fs = loop.dead;
+            loop.dead = fs->next;
+            free(fs);
+        }
+
+        if (time(NULL) != swept) {
+            swept = time(NULL);
+            evloop_sweep(&loop);
+        }
+    }
+}
+#endif
+
+/* 创建命令连接的监听套接字; 多个工作进程各自监听时由内核按 SO_REUSEPORT 分配连接 */
+int openlistener(void)
+{
+    struct sockaddr_in server;
+    int on = 1;
+
+    // p("正在创建套接字...");
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        pe("创建套接字失败: %m");
+        return -1;
+    }
+    // p("创建套接字");
+
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    if ((workers > 0 || runmode == MODE_THREADS)
+            && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        pe("设置 SO_REUSEPORT 失败: %m");
+        close(listen_fd);
+        return -1;
+    }
+#endif
+
+    bzero(&server, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_ANY);
+    server.sin_port = htons(21); // 命令连接
+    // p("正在绑定套接字...");
+    if (bind(listen_fd, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        pe("绑定套接字失败: %m");
+        close(listen_fd);
+        return -1;
+    }
+    // p("绑定套接字");
+
+    // p("正在监听套接字...");
+    if (listen(listen_fd, backlog) < 0) {
+        pe("监听套接字失败: %m");
+        close(listen_fd);
+        return -1;
+    }
+    pp("服务器启动在 %s:%d", inet_ntop(AF_INET, &server.sin_addr, buff, sizeof(buff)), ntohs(server.sin_port));
+
+    return listen_fd;
+}
+
+/* fork 模式下计入地址计数的会话进程, 由父进程在回收时扣除, 会话进程异常退出也不会漏扣 */
+struct child {
+    pid_t pid;
+    in_addr_t addr;
+    int admitted; // 已计入来源地址的会话数
+};
+
+struct child* children;
+int nchildren;
+int childcap;
+
+/* 保证还能记录一个会话进程, 内存不足时返回 -1 */
+int childroom(void)
+{
+    if (nchildren == childcap) {
+        int cap = childcap ? childcap * 2 : 64;
+        struct child* c = realloc(children, cap * sizeof(struct child));
+        if (!c) {
+            return -1;
+        }
+        children = c;
+        childcap = cap;
+    }
+    return 0;
+}
+
+/* 记录会话进程及其来源地址, 计入会话数; 须先以 childroom 保证有空位 */
+void trackchild(pid_t pid, in_addr_t addr, int admitted)
+{
+    children[nchildren].pid = pid;
+    children[nchildren].addr = addr;
+    children[nchildren].admitted = admitted;
+    nchildren++;
+    sessions_add(1);
+}
+
+/* 会话进程已回收, 扣除会话数和地址计数; 不是会话进程 (如日志写出进程) 时忽略 */
+void reapchild(pid_t pid)
+{
+    for (int i = 0; i < nchildren; i++) {
+        if (children[i].pid == pid) {
+            if (children[i].admitted) {
+                iplimit_release(children[i].addr);
+            }
+            sessions_add(-1);
+            children[i] = children[--nchildren];
+            return;
+        }
+    }
+}
+
+/* 会话进程结束: 只为打断 accept, 回收在主循环中进行 */
+void onchild(int sig)
+{
+}
+
+/* 每个连接一个进程 */
+void forkserve(int listen_fd)
+{
+    int reserve = -1;
+    pid_t pid;
+
+    struct sigaction sa;
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = onchild; // 不设 SA_RESTART, 会话进程结束时 accept 被中断, 及时回收并更新会话数
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (;;) {
+        struct sockaddr_in client;
+        // p("正在接收连接...");
+        int connect_fd = acceptconn(listen_fd, &client, 0, &reserve);
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) { // 回收已结束的会话进程, 使其计数先于本次接纳扣除
+            reapchild(pid);
+        }
+        if (connect_fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                pe("接收连接失败: %m");
+                sleep(1); // 描述符耗尽等情况下稍后重试, 不退出
+            }
+            continue;
+        }
+        // p("接收连接");
+
+        if (maxsessions > 0 && nchildren >= maxsessions) { // 本进程的会话已满, 答复 421 而不是停止接受
+            shed(connect_fd, SHED_SESSIONS);
+            continue;
+        }
+
+        int reason = overload();
+        if (reason >= 0) {
+            shed(connect_fd, reason);
+            continue;
+        }
+
+        pp("客户端请求 %s:%d", inet_ntop(AF_INET, &client.sin_addr, buff, sizeof(buff)), ntohs(client.sin_port));
+        int admit = iplimit_admit(client.sin_addr.s_addr);
+        if (admit < 0) {
+            pp("来自 %s 的会话过多, 拒绝连接", buff);
+            shed(connect_fd, SHED_IP);
+            continue;
+        }
+
+        pid = childroom() < 0 ? (errno = ENOMEM, -1) : fork();
+        if (pid < 0) {
+            pe("服务器进程创建失败: %m");
+            if (admit > 0) {
+                iplimit_release(client.sin_addr.s_addr);
+            }
+            shed(connect_fd, SHED_RESOURCE);
+            continue;
+        } else if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            close(reserve);
+            close(listen_fd);
+            // p("关闭监听描述符");
+            ftp_task(connect_fd);
+            // p("关闭连接描述符");
+            exit(0);
+        } else {
+            trackchild(pid, client.sin_addr.s_addr, admit > 0);
+        }
+        close(connect_fd);
+    }
+}
+
+#ifdef HAVE_EPOLL
+/* 线程模式下的一个分片: 绑定的 CPU、监听套接字、事件循环都归该线程独有 */
+struct shard {
+    int id;
+    int cpu;
+    int listen_fd;
+    pthread_t tid;
+};
+
+/* 分片线程: 先绑定 CPU, 之后分配的会话和缓冲区按首次访问落在本地 NUMA 节点. 不能绑定 CPU 的平台由调度器安排 */
+void* shard_main(void* arg)
+{
+    struct shard* sh = arg;
+#ifdef HAVE_AFFINITY
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(sh->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        pe("线程 %d 绑定 CPU %d 失败", sh->id, sh->cpu);
+    }
+
+    unsigned int cpu = 0, node = 0;
+    getcpu(&cpu, &node);
+    pp("线程 %d 运行在 CPU %u (NUMA 节点 %u)", sh->id, cpu, node);
+#endif
+
+    evloop_run(sh->listen_fd);
+    return NULL;
+}
+
+/* 每个 CPU 一个事件循环线程, 各自监听并且会话不跨线程迁移 */
+void threadserve(void)
+{
+#ifdef HAVE_AFFINITY
+    cpu_set_t avail;
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+
+    if (sched_getaffinity(0, sizeof(avail), &avail) < 0) {
+        CPU_ZERO(&avail);
+        CPU_SET(0, &avail);
+    }
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &avail)) {
+            cpus[ncpus++] = i;
+        }
+    }
+#else
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+#endif
+
+    int n = nthreads > 0 ? nthreads : ncpus;
+    struct shard* shards = calloc(n, sizeof(struct shard));
+    if (!shards) {
+        pe("内存不足");
+        exit(-1);
+    }
+
+    // 按顺序创建监听套接字, 使其在 SO_REUSEPORT 组中的序号与分片号一致
+    for (int i = 0; i < n; i++) {
+        shards[i].id = i;
+#ifdef HAVE_AFFINITY
+        shards[i].cpu = cpus[i % ncpus];
+#else
+        shards[i].cpu = i % ncpus;
+#endif
+        shards[i].listen_fd = openlistener();
+        if (shards[i].listen_fd < 0) {
+            exit(-1);
+        }
+    }
+
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(HAVE_AFFINITY)
+    // 按收到连接的 CPU 选择监听套接字, 使会话从握手起就留在同一个核上
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, n },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    if (n == ncpus && cpus[ncpus - 1] == ncpus - 1
+            && setsockopt(shards[0].listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        pe("按 CPU 分配连接失败, 使用内核默认的散列: %m");
+    }
+#endif
+
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&shards[i].tid, NULL, shard_main, &shards[i]) != 0) {
+            pe("创建线程 %d 失败", i);
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_join(shards[i].tid, NULL);
+    }
+}
+#endif
+
+/* 在监听套接字上按运行模式提供服务 */
+void serve(int listen_fd)
+{
+    if (runmode == MODE_EPOLL) {
+#ifdef HAVE_EPOLL
+        evloop_run(listen_fd);
+#else
+        pe("此平台不支持 epoll 模式");
+        exit(-1);
+#endif
+    }
+
+    forkserve(listen_fd);
+}
+
+volatile sig_atomic_t stopping = 0;
+
+void onstop(int sig)
+{
+    stopping = 1;
+}
+
+/* 启动一个工作进程, 各自拥有监听套接字 */
+pid_t spawnworker(int id)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        workerid = id;
+        int listen_fd = openlistener();
+        if (listen_fd < 0) {
+            exit(-1);
+        }
+        serve(listen_fd);
+        exit(0);
+    }
+    if (pid < 0) {
+        pe("工作进程 %d 创建失败: %m", id);
+    } else {
+        pp("工作进程 %d 已启动 (pid %d)", id, (int)pid);
+    }
+    return pid;
+}
+
+/* 管理进程: 预先启动工作进程, 异常退出时重新启动 */
+void supervise(void)
+{
+    pid_t* pids = calloc(workers, sizeof(pid_t));
+    time_t* started = calloc(workers, sizeof(time_t));
+    if (!pids || !started) {
+        pe("内存不足");
+        exit(-1);
+    }
+    void* p = mmap(NULL, workers * sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        pe("映射工作进程会话数失败, 工作进程异常退出后会话数可能偏高: %m");
+    } else {
+        workersessions = p;
+    }
+    if (iplimits) {
+        p = mmap(NULL, workers * IPLIMIT_SLOTS * sizeof(unsigned int), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            pe("映射工作进程地址计数失败, 工作进程异常退出后其地址的会话数可能偏高: %m");
+        } else {
+            workerips = p;
+        }
+    }
+
+    struct sigaction sa;
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = onstop; // 不设 SA_RESTART, 让 waitpid 被中断
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    for (int i = 0; i < workers; i++) {
+        pids[i] = spawnworker(i);
+        started[i] = time(NULL);
+    }
+
+    while (!stopping) {
+        int status;
+        int missing = 0; // 有工作进程未能启动时不阻塞等待, 每秒重试启动
+        for (int i = 0; i < workers; i++) {
+            missing |= pids[i] < 0;
+        }
+        pid_t pid = waitpid(-1, &status, missing ? WNOHANG : 0);
+        if (pid == 0 || (pid < 0 && errno == ECHILD)) {
+            sleep(1);
+        }
+
+        for (int i = 0; i < workers; i++) {
+            if (stopping) {
+                break;
+            }
+            if (pids[i] == pid && pid > 0) {
+                if (WIFSIGNALED(status)) {
+                    pe("工作进程 %d 被信号 %d 终止", i, WTERMSIG(status));
+                } else {
+                    pe("工作进程 %d 退出, 状态 %d", i, WEXITSTATUS(status));
+                }
+                if (workersessions) { // 它名下的会话已随之结束或不再由谁回收, 不再计入
+                    METRIC_ADD(sessions, -__atomic_exchange_n(&workersessions[i], 0, __ATOMIC_RELAXED));
+                }
+                if (workerips) {
+                    iplimit_sweep(i);
+                }
+                pids[i] = -1;
+            }
+            if (pids[i] < 0) {
+                if (time(NULL) - started[i] < 1) { // 反复崩溃时放慢重启
+                    sleep(1);
+                }
+                pids[i] = spawnworker(i);
+                started[i] = time(NULL);
+            }
+        }
+    }
+
+    pp("服务器停止");
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        while (pids[i] > 0 && waitpid(pids[i], NULL, 0) < 0 && errno == EINTR) {
+        }
+    }
+    if (logkeeper > 0) { // 工作进程的日志都已入环, 让写出进程写完后退出; 导出进程随本进程退出
+        kill(logkeeper, SIGTERM);
+        while (waitpid(logkeeper, NULL, 0) < 0 && errno == EINTR) {
+        }
+    }
+    exit(0);
+}
+
+/* 写出进程收到停止信号后写完环中剩余的日志再退出 */
+volatile sig_atomic_t logstop = 0;
+
+void onlogstop(int sig)
+{
+    logstop = 1;
+}
+
+void log_atfork(void)
+{
+    logpid = getpid();
+}
+
+/* 写出进程: 批量取出日志, 写到日志文件, 或写到标准错误并转给 syslog */
+void log_write(int fd)
+{
+    struct logring* r = logring;
+    static char batch[LOGBATCH * (LOGMSG + 64)];
+    long long stuck = 0; // 发现 head 处的槽已被抢占但未发布的时刻
+
+    for (;;) {
+        size_t len = 0;
+        int n = 0;
+        while (n < LOGBATCH) {
+            struct logrec* rec = &r->recs[r->head & (LOGSLOTS - 1)];
+            unsigned long seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+            if (seq != r->head + 1) {
+                if (seq == r->head && __atomic_load_n(&r->tail, __ATOMIC_RELAXED) != r->head) {
+                    long long now = nowus();
+                    if (!stuck) {
+                        stuck = now;
+                    } else if (now - stuck > LOGSTUCK
+                            && __atomic_compare_exchange_n(&rec->seq, &seq, r->head + LOGSLOTS, 0,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED); // 写入方死在抢占与发布之间
+                        __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELAXED);
+                        stuck = 0;
+                        continue;
+                    }
+                }
+                break;
+            }
+            stuck = 0;
+            if (logfile) {
+                struct tm tm;
+                localtime_r(&rec->when, &tm);
+                len += strftime(batch + len, 32, "%F %T ", &tm);
+                len += sprintf(batch + len, "[%d] %s: %s\n", rec->pid, logtag(rec->level), rec->msg);
+            } else {
+                len += sprintf(batch + len, "%s: %s\n", logtag(rec->level), rec->msg);
+                syslog(rec->level, "[%d] %s", rec->pid, rec->msg);
+            }
+            __atomic_store_n(&rec->seq, r->head + LOGSLOTS, __ATOMIC_RELEASE);
+            __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELAXED);
+            n++;
+        }
+        if (len) {
+            writeall(fd, batch, len);
+        }
+        if (n == 0) {
+            if (logstop) {
+                exit(0);
+            }
+            usleep(5000); // 空闲时轮询, 不让写入方为唤醒付出系统调用
+        }
     }
+}
 
-    fs->dataport = port;
+/* 写出进程的看护进程: 写出进程异常退出时重新启动, 环中的丢弃数增加时报告到标准错误;
+ * 收到停止信号时让写出进程写完剩余的日志后一同退出. 它在其他线程启动之前派生, 始终是单线程, 可以安全地再派生 */
+void log_keep(int fd)
+{
+    struct logring* r = logring;
+    unsigned long dropped = 0;
 
-    if (htonl(ip) != fs->peer.sin_addr.s_addr) {
-        addreply(fs, 425, "不会打开到 %d.%d.%d.%d 的连接 (仅限 %s)",
-                (ip >> 24) & 255, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255,
-                inet_ntoa(fs->peer.sin_addr));
-        close(fs->datasock);
-        fs->datasock = -1;
-        return;
-    }
+    while (!logstop) {
+        time_t started = time(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+#ifdef PR_SET_PDEATHSIG
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            log_write(fd);
+        }
+        if (pid < 0) {
+            fprintf(stderr, "%s: 日志写出进程创建失败: %s\n", logtag(LOG_ERR), strerror(errno));
+            sleep(1);
+            continue;
+        }
 
-    fs->passive = 0;
+        int status;
+        while (waitpid(pid, &status, WNOHANG) == 0) {
+            if (logstop) {
+                kill(pid, SIGTERM);
+                waitpid(pid, NULL, 0);
+                exit(0);
+            }
+            unsigned long d = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+            if (d != dropped) {
+                fprintf(stderr, "%s: 日志已丢弃 %lu 条\n", logtag(LOG_ERR), d);
+                dropped = d;
+            }
+            sleep(1); // 停止信号会打断等待
+        }
 
-    addreply(fs, 200, "PORT 命令完成");
+        if (logstop) { // 写出进程与看护进程同时收到了停止信号 (如终端的 Ctrl-C)
+            break;
+        }
+        __atomic_fetch_add(&r->restarts, 1, __ATOMIC_RELAXED);
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "%s: 日志写出进程被信号 %d 终止, 重新启动\n", logtag(LOG_ERR), WTERMSIG(status));
+        } else {
+            fprintf(stderr, "%s: 日志写出进程退出, 状态 %d, 重新启动\n", logtag(LOG_ERR), WEXITSTATUS(status));
+        }
+        if (time(NULL) - started < 1) { // 反复崩溃时放慢重启
+            sleep(1);
+        }
+    }
+    exit(0);
 }
 
-/* 被动模式 */
-void dopasv(struct ftpstate* fs)
+/* 映射日志环并启动写出进程; 失败时保持同步写出 */
+void log_init(void)
 {
-    struct sockaddr_in sin;
-    unsigned int len;
-
-    if (fs->datasock != -1) {
-        close(fs->datasock);
-        fs->datasock = -1;
-    }
+    logpid = getpid();
+    pthread_atfork(NULL, NULL, log_atfork);
 
-    len = sizeof(sin);
-    if (getsockname(fs->ctrlsock, (struct sockaddr*)&sin, &len) < 0) {
-        doerror(fs, 425, "无法获取套接字名");
+    int fd = 2;
+    if (logfile && (fd = open(logfile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640)) < 0) {
+        pe("无法打开日志文件 %s: %m", logfile);
         return;
     }
 
-    fs->datasock = socket(AF_INET, SOCK_STREAM, 0);
-    if (fs->datasock < 0) {
-        doerror(fs, 425, "无法打开被动连接");
+    struct logring* r = mmap(NULL, sizeof(struct logring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED) {
+        pe("映射日志环失败, 同步写日志: %m");
         return;
     }
-
-    sin.sin_port = 0;
-    if (bind(fs->datasock, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
-        doerror(fs, 425, "无法绑定套接字");
-        return;
+    r->level = loglevel;
+    for (int i = 0; i < LOGSLOTS; i++) {
+        r->recs[i].seq = i;
     }
 
-    len = sizeof(sin);
-    if (getsockname(fs->datasock, (struct sockaddr*)&sin, &len) < 0) {
-        doerror(fs, 425, "无法获取套接字名");
+    pid_t pid = fork();
+    if (pid < 0) {
+        pe("日志写出进程创建失败: %m");
+        munmap(r, sizeof(*r));
         return;
     }
-
-    listen(fs->datasock, 1);
-
-    unsigned int a = ntohl(sin.sin_addr.s_addr);
-    unsigned int p = ntohs(sin.sin_port);
-    addreply(fs, 227, "启用被动模式 (%d,%d,%d,%d,%d,%d)", (a >> 24) & 255, (a >> 16) & 255, (a >> 8) & 255, a & 255, (p >> 8) & 255, p & 255);
-
-    fs->passive = 1;
+    if (pid == 0) {
+#ifdef PR_SET_PDEATHSIG
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        signal(SIGTERM, onlogstop);
+        signal(SIGINT, onlogstop);
+        logring = r;
+        log_keep(fd);
+    }
+    if (fd != 2) {
+        close(fd);
+    }
+    logkeeper = pid;
+    logring = r;
 }
 
-void dohelp(struct ftpstate* fs, char* arg)
+/* 按格式追加到动态增长的缓冲区 */
+void mprintf(char** buf, size_t* len, size_t* cap, const char* fmt, ...)
 {
-    static char* helps[] = { 
-        "user <username>",
-        "pass <password>",
-        "acct <account-information>",
-        "cwd  <pathname>",
-        "cdup",
-        "smnt <pathname>",
-        "quit",
-        "rein",
-        "port <host-port>",
-        "pasv",
-        "type <type-code>",
-        "stru <structure-code>",
-        "mode <mode-code>",
-        "retr <pathname>",
-        "stor <pathname>",
-        "stou",
-        "appe <pathname>",
-        "allo [r] <decimal-integer>",
-        "rest <marker>",
-        "rnfr <pathname>",
-        "rnto <pathname>",
-        "abor",
-        "dele <pathname>",
-        "rmd  <pathname>",
-        "mkd  <pathname>",
-        "pwd ",
-        "list [<pathname>]",
-        "nlst [<pathname>]",
-        "site <string>",
-        "syst",
-        "stat [<pathname>]",
-        "help [<string>]",
-        "noop"
-    };
-    int len = sizeof(helps);
-    if (arg && *arg) {
-        for (int i = 0; i < len; i++) {
-            size_t l = strlen(arg);
-            if (strncmp(arg, helps[i], l) == 0) {
-                addreply(fs, 200, "用法: %s", helps[i]);
-                return;
-            }
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return;
         }
-    }
-    for (int i = 0; i < len; i++) {
-        addreply(fs, 0, "%s", helps[i]);
+        if (*len + n < *cap) {
+            *len += n;
+            return;
+        }
+        char* p = realloc(*buf, *cap * 2 + n);
+        if (!p) {
+            return;
+        }
+        *buf = p;
+        *cap = *cap * 2 + n;
     }
 }
 
-/* 执行命令 */
-int docmd(struct ftpstate* fs)
+/* 输出一个直方图, 桶的上界按 scale 换算 (微秒换成秒) */
+void metrics_hist(char** buf, size_t* len, size_t* cap, const char* name, const char* kind,
+        struct histogram* h, double scale)
 {
-    char* arg;
-    char* cmd;
-    unsigned long cmdsize;
-    int n = 0;
-
-    if (!fgets(fs->cmd, sizeof(fs->cmd), fs->in)) {
-        if (errno == ETIMEDOUT) {
-            addreply(fs, 421, "超时 (%d 秒)", fs->idletime / 1000);
-        }
-        return -1;
+    unsigned long cum = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        cum += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        mprintf(buf, len, cap, "%s_bucket{kind=\"%s\",le=\"%g\"} %lu\n", name, kind, (double)(2ULL << i) * scale, cum);
     }
-    cmd = fs->cmd;
-    cmdsize = strlen(cmd);
+    mprintf(buf, len, cap, "%s_bucket{kind=\"%s\",le=\"+Inf\"} %lu\n", name, kind, cum);
+    mprintf(buf, len, cap, "%s_sum{kind=\"%s\"} %g\n", name, kind, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) * scale);
+    mprintf(buf, len, cap, "%s_count{kind=\"%s\"} %lu\n", name, kind, __atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
 
-    if (fs->debug) {
-        addreply(fs, 0, "%s", cmd);
+/* 以 Prometheus 文本格式输出所有共享计数, 返回的缓冲区由调用者释放 */
+char* metrics_render(size_t* len)
+{
+    static const char* kinds[] = { NULL, "retr", "stor", "list" };
+    size_t cap = 16384;
+    char* buf = malloc(cap);
+    if (!buf) {
+        return NULL;
     }
-
-    n = 0;
-    while (isalpha(cmd[n]) && n < cmdsize) {
-        cmd[n] = tolower(cmd[n]);
-        n++;
+    *len = 0;
+
+#define LOAD(field) (metrics ? __atomic_load_n(&metrics->field, __ATOMIC_RELAXED) : 0)
+    mprintf(&buf, len, &cap, "# TYPE ftpd_sessions_active gauge\nftpd_sessions_active %ld\n", LOAD(sessions));
+    mprintf(&buf, len, &cap, "# TYPE ftpd_sessions_total counter\nftpd_sessions_total %lu\n", LOAD(sessions_total));
+    mprintf(&buf, len, &cap, "# TYPE ftpd_logins_total counter\nftpd_logins_total{user=\"anonymous\"} %lu\n"
+            "ftpd_logins_total{user=\"local\"} %lu\n", LOAD(logins_anon), LOAD(logins_user));
+    mprintf(&buf, len, &cap, "# TYPE ftpd_login_failures_total counter\nftpd_login_failures_total %lu\n", LOAD(login_failures));
+    mprintf(&buf, len, &cap, "# TYPE ftpd_bytes_total counter\nftpd_bytes_total{direction=\"in\"} %lu\n"
+            "ftpd_bytes_total{direction=\"out\"} %lu\n", LOAD(bytes_in), LOAD(bytes_out));
+    mprintf(&buf, len, &cap, "# TYPE ftpd_data_connection_failures_total counter\n"
+            "ftpd_data_connection_failures_total %lu\n", LOAD(data_failures));
+    mprintf(&buf, len, &cap, "# TYPE ftpd_connections_rejected_total counter\n");
+    static const char* reasons[SHED_REASONS] = { "per_ip", "sessions", "load", "descriptors", "resources" };
+    for (int r = 0; r < SHED_REASONS; r++) {
+        mprintf(&buf, len, &cap, "ftpd_connections_rejected_total{reason=\"%s\"} %lu\n", reasons[r], LOAD(rejected[r]));
     }
-
-    if (!n) {
-        addreply(fs, 221, "再见");
-        return 0;
+    mprintf(&buf, len, &cap, "# TYPE ftpd_shaping_waits_total counter\nftpd_shaping_waits_total %lu\n"
+            "# TYPE ftpd_shaping_wait_seconds_total counter\nftpd_shaping_wait_seconds_total %.6f\n",
+            LOAD(shape_waits), LOAD(shape_wait_us) / 1e6);
+    mprintf(&buf, len, &cap, "# TYPE ftpd_retr_files_total counter\nftpd_retr_files_total{cache=\"hot\"} %lu\n"
+            "ftpd_retr_files_total{cache=\"cold\"} %lu\n", LOAD(retr_hot), LOAD(retr_cold));
+    mprintf(&buf, len, &cap, "# TYPE ftpd_page_cache_dropped_bytes_total counter\n"
+            "ftpd_page_cache_dropped_bytes_total %lu\n", LOAD(cache_dropped));
+#undef LOAD
+
+    if (cmdcounts) {
+        mprintf(&buf, len, &cap, "# TYPE ftpd_commands_total counter\n");
+        const struct command* c = commands;
+        for (; c->verb; c++) {
+            mprintf(&buf, len, &cap, "ftpd_commands_total{verb=\"%s\"} %lu\n", c->name,
+                    __atomic_load_n(&cmdcounts[c - commands], __ATOMIC_RELAXED));
+        }
+        mprintf(&buf, len, &cap, "ftpd_commands_total{verb=\"unknown\"} %lu\n",
+                __atomic_load_n(&cmdcounts[c - commands], __ATOMIC_RELAXED));
     }
 
-    while (isspace(cmd[n]) && n < cmdsize) {
-        cmd[n++] = '\0';
+    if (xferstats) {
+        mprintf(&buf, len, &cap, "# TYPE ftpd_transfer_errors_total counter\n");
+        for (int k = XFER_RETR; k <= XFER_LIST; k++) {
+            mprintf(&buf, len, &cap, "ftpd_transfer_errors_total{kind=\"%s\"} %lu\n", kinds[k],
+                    __atomic_load_n(&xferstats[k].errors, __ATOMIC_RELAXED));
+        }
+        mprintf(&buf, len, &cap, "# TYPE ftpd_transfer_first_byte_seconds histogram\n");
+        for (int k = XFER_RETR; k <= XFER_LIST; k++) {
+            metrics_hist(&buf, len, &cap, "ftpd_transfer_first_byte_seconds", kinds[k], &xferstats[k].ttfb, 1e-6);
+        }
+        mprintf(&buf, len, &cap, "# TYPE ftpd_transfer_duration_seconds histogram\n");
+        for (int k = XFER_RETR; k <= XFER_LIST; k++) {
+            metrics_hist(&buf, len, &cap, "ftpd_transfer_duration_seconds", kinds[k], &xferstats[k].duration, 1e-6);
+        }
     }
-    arg = cmd + n;
 
-    while (cmd[n] && n < cmdsize) {
-        n++;
+    if (logring) {
+        mprintf(&buf, len, &cap, "# TYPE ftpd_log_dropped_total counter\nftpd_log_dropped_total %lu\n",
+                __atomic_load_n(&logring->dropped, __ATOMIC_RELAXED));
+        mprintf(&buf, len, &cap, "# TYPE ftpd_log_writer_restarts_total counter\nftpd_log_writer_restarts_total %lu\n",
+                __atomic_load_n(&logring->restarts, __ATOMIC_RELAXED));
     }
-    n--;
 
-    while (isspace(cmd[n])) {
-        cmd[n--] = '\0';
+    if (names) {
+        mprintf(&buf, len, &cap, "# TYPE ftpd_namecache_lookups_total counter\n"
+                "ftpd_namecache_lookups_total{result=\"hit\"} %lu\nftpd_namecache_lookups_total{result=\"miss\"} %lu\n",
+                __atomic_load_n(&names->hits, __ATOMIC_RELAXED), __atomic_load_n(&names->misses, __ATOMIC_RELAXED));
     }
+    return buf;
+}
 
-    pp("命令 [%s %s]", cmd, arg);
-    if (strcmp(cmd, "user") == 0) {        // USER NAME
-        douser(fs, arg);
-    } else if (strcmp(cmd, "pass") == 0) { // PASSWORD
-        dopass(fs, arg);
-    } else if (strcmp(cmd, "acct") == 0) { // ACCOUNT
-        addreply(fs, 500, "不支持账户认证");
-    } else if (strcmp(cmd, "quit") == 0) { // LOGOUT
-        addreply(fs, 221, "再见");
-        return 0;
-    } else if (strcmp(cmd, "feat") == 0) { // Feature
-        addreply(fs, 500, "不支持 RFC 959 以外的命令");
-    } else if (strcmp(cmd, "port") == 0) { // DATA PORT
-        unsigned int a1, a2, a3, a4, p1, p2;
-        if (sscanf(arg, "%u,%u,%u,%u,%u,%u", &a1, &a2, &a3, &a4, &p1, &p2) == 6
-                && a1 < 256 && a2 < 256 && a3 < 256 && a4 < 256 && p1 < 256 && p2 < 256) {
-            doport(fs, (a1 << 24) + (a2 << 16) + (a3 << 8) + a4, ((p1 << 8) + p2));
-        } else {
-            addreply(fs, 501, "语法错误");
-        }
-    } else if (strcmp(cmd, "pasv") == 0) { // PASSIVE
-        dopasv(fs);
-    } else if (strcmp(cmd, "syst") == 0) { // SYSTEM
-        struct utsname unameData;
-        if (uname(&unameData) == 0) {
-            addreply(fs, 215, "%s", unameData.sysname);
-        }
-    } else if (strcmp(cmd, "help") == 0) { // HELP
-        dohelp(fs, arg);
-    } else if (strcmp(cmd, "noop") == 0) { // NOOP
-        addreply(fs, 200, "冒个泡");
+/* 打开导出端点: 含 '/' 时为 unix 套接字路径, 否则为 127.0.0.1 上的端口 */
+int metrics_listen(const char* addr)
+{
+    int fd;
+
+    if (strchr(addr, '/')) {
+        struct sockaddr_un sun;
+        bzero(&sun, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", addr);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            pe("创建导出套接字失败: %m");
+            return -1;
+        }
+        unlink(addr);
+        if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0) {
+            pe("导出端点 %s 绑定失败: %m", addr);
+            close(fd);
+            return -1;
+        }
     } else {
-        goto login_logic;
+        struct sockaddr_in sin;
+        bzero(&sin, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(atoi(addr));
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            pe("创建导出套接字失败: %m");
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+            pe("导出端点 127.0.0.1:%s 绑定失败: %m", addr);
+            close(fd);
+            return -1;
+        }
     }
-    return 1;
+    if (listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-login_logic:
-    douser(fs, NULL);
+/* 导出进程: 对 GET /metrics 以 HTTP 回应当前计数, 其他请求回应 404; 只看请求行, 不解析请求头 */
+void metrics_serve(int fd)
+{
+    struct timeval tv = { 2, 0 };
 
-    if (strcmp(cmd, "cwd") == 0) {         // CHANGE WORKING DIRECTORY
-        docwd(fs, arg);
-    } else if (strcmp(cmd, "cdup") == 0) { // CHANGE TO PARENT DIRECTORY
-        docwd(fs, "..");
-    } else if (strcmp(cmd, "smnt") == 0) { // STRUCTURE MOUNT
-        addreply(fs, 200, "不支持挂载结构");
-    } else if (strcmp(cmd, "rein") == 0) { // REINITIALIZE
-        fs->loggedin = 0;
-        fs->uid = -1;
-        addreply(fs, 220, "服务已为新用户准备好");
-    } else if (strcmp(cmd, "retr") == 0) { // RETRIEVE
-        if (arg && *arg) {
-            doretr(fs, arg);
-        } else {
-            addreply(fs, 501, "缺少文件名");
-        }
-    } else if (strcmp(cmd, "type") == 0) { // REPRESENTATION TYPE
-        if (arg && tolower(*arg) == 'i') { // Image
-            addreply(fs, 200, "二进制类型文件");
-        } else {
-            addreply(fs, 504, "只支持二进制类型文件");
-        }
-    } else if (strcmp(cmd, "stru") == 0) { // FILE STRUCTURE
-        if (arg && tolower(*arg) == 'f') { // File
-            addreply(fs, 200, "文件结构");
-        } else {
-            addreply(fs, 504, "只支持文件结构");
+    for (;;) {
+        int c = accept(fd, NULL, NULL);
+        if (c < 0) {
+            continue;
         }
-    } else if (strcmp(cmd, "mode") == 0) { // TRANSFER MODE
-        if (arg && tolower(*arg) == 's') { // Stream
-            addreply(fs, 200, "流模式");
-        } else {
-            addreply(fs, 504, "只支持流模式");
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        char req[1024];
+        size_t got = 0;
+        while (got < sizeof(req) - 1) { // 读到请求头结束
+            ssize_t n = recv(c, req + got, sizeof(req) - 1 - got, 0);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+            req[got] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+                break;
+            }
         }
-    } else if (strcmp(cmd, "retr") == 0) { // RETRIEVE
-    } else if (strcmp(cmd, "stor") == 0) { // STORE
-        if (arg && *arg) {
-            dostor(fs, arg);
-        } else {
-            addreply(fs, 501, "缺少文件名");
-        }
-    } else if (strcmp(cmd, "stou") == 0) { // STORE UNIQUE
-    } else if (strcmp(cmd, "appe") == 0) { // APPEND (with create)
-    } else if (strcmp(cmd, "allo") == 0) { // ALLOCATE
-    } else if (strcmp(cmd, "rest") == 0) { // RESTART
-    } else if (strcmp(cmd, "rnfr") == 0) { // RENAME FROM
-    } else if (strcmp(cmd, "rnto") == 0) { // RENAME TO
-    } else if (strcmp(cmd, "abor") == 0) { // ABORT
-        addreply(fs, 226, "中止");
-    } else if (strcmp(cmd, "dele") == 0) { // DELETE
-        if (arg && *arg) {
-            dodele(fs, arg);
+
+        size_t len = 0;
+        char* body = NULL;
+        if (got == 0 || strncmp(req, "GET /metrics", 12) != 0 || !strchr(" ?\r\n", req[12])) {
+            static const char notfound[] = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+                    "Content-Length: 10\r\n\r\nnot found\n";
+            sendall(c, notfound, sizeof(notfound) - 1);
         } else {
-            addreply(fs, 501, "缺少文件名");
+            body = metrics_render(&len);
         }
-    } else if (strcmp(cmd, "rmd") == 0) {  // REMOVE DIRECTORY
-        if (arg && *arg) {
-            dormd(fs, arg);
-        } else {
-            addreply(fs, 550, "缺少目录名");
+        if (body) {
+            char head[128];
+            int hl = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %zu\r\n\r\n", len);
+            if (sendall(c, head, hl) == 0) {
+                sendall(c, body, len);
+            }
+            free(body);
         }
-    } else if (strcmp(cmd, "mkd") == 0) {  // MAKE DIRECTORY
-        if (arg && *arg) {
-            domkd(fs, arg);
-        } else {
-            addreply(fs, 501, "缺少目录名");
-        }
-    } else if (strcmp(cmd, "pwd") == 0) {  // PRINT WORKING DIRECTORY
-        addreply(fs, 257, "\"%s\"", fs->wd);
-    } else if (strcmp(cmd, "list") == 0) { // LIST
-        dolist(fs, (arg && *arg) ? arg : "-l");
-    } else if (strcmp(cmd, "nlst") == 0) { // NAME LIST
-        dolist(fs, arg);
-    } else if (strcmp(cmd, "site") == 0) { // SITE PARAMETERS
-        addreply(fs, 200, "没什么可做的");
-    }
-    else {
-        addreply(fs, 500, "未知命令");
+        close(c);
     }
-    return 1;
 }
 
-/* FTP 服务器进程 */
-void ftp_task(int fd)
+/* 启动导出进程, 端点在父进程中打开以便及早报告错误 */
+void metrics_spawn(void)
 {
-    // p("新服务器进程！");
+    if (!metricsaddr) {
+        return;
+    }
+    int fd = metrics_listen(metricsaddr);
+    if (fd < 0) {
+        return;
+    }
 
-    struct ftpstate state;
+    pid_t pid = fork();
+    if (pid == 0) {
+#ifdef PR_SET_PDEATHSIG
+        prctl(PR_SET_PDEATHSIG, SIGTERM); // 随服务器一同退出
+#endif
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        metrics_serve(fd);
+        exit(0);
+    }
+    if (pid < 0) {
+        pe("导出进程创建失败: %m");
+    } else {
+        pp("计数导出在 %s", metricsaddr);
+    }
+    close(fd);
+}
 
-    bzero(&state, sizeof(state));
-    state.ctrlsock = fd;
-    state.datasock = 1;
-    state.uid = -1;
+#ifdef FTPD_BENCHMARK // 编译时加 -DFTPD_BENCHMARK 启用 -B 基准测试, 正式版本不带
 
-    socklen_t len = sizeof(state.peer);
-    getpeername(fd, (struct sockaddr*)&state.peer, &len);
+/* 一轮基准测试: 经回环 TCP 连接把文件发给排空进程, 返回每秒字节数; netdelay 为每步发送后等待的微秒数,
+ * 模拟发送一个缓冲区要等待的慢网络 (如受限速), 串行读写时读盘与之相加, 流水线时二者重叠.
+ * 失败时返回 -1, errno 为原因; 每条路径都关闭打开的描述符并回收排空进程 */
+double benchround(const char* path, int mode, long netdelay)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    struct stat st;
+    struct timespec t0, t1;
+    int lfd = -1, cfd = -1, sock = -1;
+    pid_t pid = -1;
+    double rate = -1;
+    int err;
+    struct transfer x;
+
+    bzero(&x, sizeof(x));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        goto out;
+    }
 
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timedout, sizeof(timedout));
-    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timedout, sizeof(timedout));
+    bzero(&sin, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    cfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 || cfd < 0 || bind(lfd, (struct sockaddr*)&sin, sizeof(sin)) < 0 || listen(lfd, 1) < 0
+            || getsockname(lfd, (struct sockaddr*)&sin, &len) < 0
+            || connect(cfd, (struct sockaddr*)&sin, sizeof(sin)) < 0
+            || (sock = accept(lfd, NULL, NULL)) < 0) {
+        goto out;
+    }
+    close(lfd);
+    lfd = -1;
 
-    state.in = fdopen(fd, "r");
-    if (!state.in) {
-        close(fd);
-        pe("打开读描述符失败");
-        return;
+    pid = fork();
+    if (pid == 0) {
+        char buf[65536];
+        close(sock);
+        while (read(cfd, buf, sizeof(buf)) > 0) {
+        }
+        _exit(0);
+    }
+    close(cfd);
+    cfd = -1;
+    if (pid < 0) {
+        goto out;
     }
 
-    state.out = fdopen(dup(fd), "w");
-    if (!state.out) {
-        close(fd);
-        pe("打开写描述符失败");
-        return;
+    x.fd = fd;
+    x.sock = sock;
+    x.end = st.st_size;
+    x.chunk = XFERCHUNK;
+    x.pfd[0] = x.pfd[1] = -1;
+    if (mode == 0) {
+        x.buf = malloc(XFERBUF); // 预先分配缓冲区即走普通读写
+        x.len = x.off = 0;
+    }
+    x.kind = XFER_RETR;
+    if (mode == 3 && xferpipe_start(&x) < 0) {
+        goto out;
     }
 
-    addreply(&state, 220, "欢迎");
-    for (;;) {
-        doreply(&state);
-        // p("正在执行命令...");
-        if (docmd(&state) <= 0) {
-            break;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ret;
+    do {
+#ifdef HAVE_LIBURING
+        if (mode == 2) {
+            ret = uring_retr_step(&x);
+            continue;
         }
-        // p("执行命令");
+#endif
+        ret = retr_step(&x);
+        if (netdelay > 0 && ret > 0) {
+            usleep(netdelay);
+        }
+    } while (ret > 0);
+    xferpipe_end(&x);
+    close(sock); // 排空进程读到结束后退出
+    sock = -1;
+    waitpid(pid, NULL, 0);
+    pid = -1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (ret == 0 && t > 0) {
+        rate = st.st_size / t;
     }
-    doreply(&state);
 
-    if (state.renamefrom) {
-        free(state.renamefrom);
+out:
+    err = errno;
+    if (sock >= 0) {
+        close(sock);
     }
-    if (state.in) {
-        fclose(state.in);
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
     }
-    if (state.out) {
-        fclose(state.out);
+    if (lfd >= 0) {
+        close(lfd);
     }
-    if (state.datasock != -1) {
-        close(state.datasock);
+    if (cfd >= 0) {
+        close(cfd);
     }
-
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(x.buf);
+    errno = err;
+    return rate;
 }
 
-int main(int argc, char* argv[])
+/* 基准测试: 比较各种下载方式的吞吐. 参数为 文件[:读盘延迟微秒[:网络延迟微秒]], 给出延迟时只比较
+ * 串行读写与流水线, 每读一个缓冲区 (XFERBUF) 等待给定的时间, 模拟慢盘和慢网络 */
+void benchmark(const char* arg)
 {
-    int ret;
-    int listen_fd;
-    struct sockaddr_in server;
-
-    openlog("FTPServer", LOG_PID | LOG_NDELAY, LOG_FTP);
+    static const char* names[] = { "read/send", "sendfile", "io_uring", "pipeline" };
+    char path[MAXPATH];
+    long netdelay = 0;
+
+    snprintf(path, sizeof(path), "%s", arg);
+    char* p = strchr(path, ':');
+    if (p) {
+        *p++ = '\0';
+        diskdelay = strtol(p, &p, 10);
+        if (*p == ':') {
+            netdelay = strtol(p + 1, NULL, 10);
+        }
+        printf("模拟读盘延迟 %ld 微秒, 网络延迟 %ld 微秒 (每 %d 字节)\n", diskdelay, netdelay, XFERBUF);
+    }
 
-    // p("正在创建套接字...");
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-        pe("创建套接字失败: %m");
-        exit(-1);
+    for (int mode = 0; mode < 4; mode++) {
+        if (p && (mode == 1 || mode == 2)) {
+            continue; // 零拷贝方式不经过模拟的慢盘
+        }
+#ifdef HAVE_LIBURING
+        if (mode == 2 && uring_setup() < 0) {
+            printf("%-10s 不可用\n", names[mode]);
+            continue;
+        }
+#else
+        if (mode == 2) {
+            printf("%-10s 未编译 (需 -DHAVE_LIBURING -luring)\n", names[mode]);
+            continue;
+        }
+#endif
+        double best = 0;
+        for (int round = 0; round < 3; round++) {
+            double rate = benchround(path, mode, netdelay);
+            if (rate < 0) {
+                printf("%-10s 失败: %s\n", names[mode], strerror(errno));
+                break;
+            }
+            if (rate > best) {
+                best = rate;
+            }
+        }
+        printf("%-10s %10.1f MB/s\n", names[mode], best / 1024 / 1024);
     }
-    // p("创建套接字");
+}
+#endif
 
-    bzero(&server, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(21); // 命令连接
-    // p("正在绑定套接字...");
-    ret = bind(listen_fd, (struct sockaddr*)&server, sizeof(server));
-    if (ret < 0) {
-        pe("绑定套接字失败: %m");
-        exit(-1);
+int main(int argc, char* argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "m:w:b:c:uB:t:L:R:T:N:M:l:o:S:P:I:C:A:W:D:a:")) != -1) {
+        switch (opt) {
+            case 'm': // 运行模式
+                if (strcmp(optarg, "fork") == 0) {
+                    runmode = MODE_FORK;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    runmode = MODE_EPOLL;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    runmode = MODE_THREADS;
+                } else {
+                    fprintf(stderr, "未知模式 %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'w': // 工作进程数
+                workers = atoi(optarg);
+                break;
+            case 'b': // 监听队列长度
+                backlog = atoi(optarg);
+                break;
+            case 'c': // 每个工作进程的最大会话数
+                maxsessions = atoi(optarg);
+                break;
+            case 'C': // 所有工作进程合计的会话上限
+                sessionmax = atoi(optarg);
+                break;
+            case 'A': // 拒绝新连接的一分钟平均负载
+                loadmax = atof(optarg);
+                break;
+            case 't': // 线程模式下的线程数
+                nthreads = atoi(optarg);
+                break;
+            case 'L': // 目录列表缓存的内存预算 (KB)
+                listcachemax = (size_t)atol(optarg) * 1024;
+                break;
+            case 'R': // 估算带宽时延积所用的链路速率 (Mbit/s)
+                tunerate = atol(optarg) * 1000000 / 8;
+                break;
+            case 'T': // 数据连接套接字缓冲区的上限 (KB)
+                tunemax = atoi(optarg) * 1024;
+                break;
+            case 'N': // 事件模式下的 TCP_NOTSENT_LOWAT (KB), 0 表示不设置
+                notsentlowat = atoi(optarg) * 1024;
+                break;
+            case 'W': // 上传写后回写窗口 (MB), 0 表示不干预
+                writebehind = atol(optarg) * 1024 * 1024;
+                break;
+            case 'D': // 下载时逐出页缓存的文件大小下限 (MB), 0 表示不逐出
+                dropsize = atol(optarg) * 1024 * 1024;
+                break;
+            case 'M': // 计数导出端点: 端口或 unix 套接字路径
+                metricsaddr = optarg;
+                break;
+            case 'S': { // 限速 (KB/s): 全局,匿名用户,登录用户,每会话, 可只给前几项
+                char* p = optarg;
+                for (int i = 0; i <= SHAPE_SESSION && *p; i++) {
+                    shaperate[i] = strtol(p, &p, 10) * 1024;
+                    if (*p == ',') {
+                        p++;
+                    }
+                }
+                break;
+            }
+            case 'P': // 每个地址的会话上限
+                iplimitmax = atoi(optarg);
+                break;
+            case 'I': { // 单独设置地址段的会话上限: 地址[/前缀长度]=上限, 可多次给出
+                char net[INET_ADDRSTRLEN];
+                int bits = 32, limit;
+                struct in_addr in;
+                if ((sscanf(optarg, "%15[0-9.]/%d=%d", net, &bits, &limit) != 3
+                            && sscanf(optarg, "%15[0-9.]=%d", net, &limit) != 2)
+                        || bits < 0 || bits > 32 || inet_pton(AF_INET, net, &in) != 1) {
+                    fprintf(stderr, "无效的地址上限 %s\n", optarg);
+                    exit(-1);
+                }
+                if (nipquotas == IPQUOTA_MAX) {
+                    fprintf(stderr, "地址上限最多 %d 项\n", IPQUOTA_MAX);
+                    exit(-1);
+                }
+                ipquotas[nipquotas].mask = bits ? htonl(0xffffffffu << (32 - bits)) : 0;
+                ipquotas[nipquotas].net = in.s_addr & ipquotas[nipquotas].mask;
+                ipquotas[nipquotas].limit = limit;
+                nipquotas++;
+                break;
+            }
+            case 'l': // 日志级别
+                loglevel = strcmp(optarg, "debug") == 0 ? LOG_DEBUG : strcmp(optarg, "error") == 0 ? LOG_ERR
+                        : strcmp(optarg, "off") == 0 ? -1 : LOG_INFO;
+                break;
+            case 'o': // 日志文件
+                logfile = optarg;
+                break;
+            case 'a': { // 可用 SITE LOG 调整日志级别的管理用户: 用户名或 uid
+                struct passwd* pw = getpwnam(optarg);
+                adminuid = pw ? (int)pw->pw_uid : isdigit((unsigned char)*optarg) ? atoi(optarg) : -1;
+                if (adminuid < 0) {
+                    fprintf(stderr, "未知用户 %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'u': // 使用 io_uring 后端
+#ifndef HAVE_LIBURING
+                fprintf(stderr, "未编译 io_uring 支持, 使用阻塞 I/O\n");
+#endif
+                useuring = 1;
+                break;
+            case 'B': // 基准测试
+#ifdef FTPD_BENCHMARK
+                benchmark(optarg);
+                exit(0);
+#else
+                fprintf(stderr, "未编译基准测试 (需 -DFTPD_BENCHMARK)\n");
+                exit(-1);
+#endif
+            default:
+                fprintf(stderr, "用法: %s [-m fork|epoll|threads] [-t 线程数] [-w 工作进程数] [-b 监听队列长度] [-c 最大会话数] [-C 合计会话数] [-A 负载上限] [-L 列表缓存KB] [-R 链路Mbit/s] [-T 缓冲区上限KB] [-N 未发送下限KB] [-W 回写窗口MB] [-D 逐出缓存文件MB] [-S 全局,匿名,登录,会话KB/s] [-P 每地址会话数] [-I 地址[/前缀]=会话数] [-M 导出端口或路径] [-l debug|info|error|off] [-o 日志文件] [-a 管理用户] [-u] [-B 测试文件[:读盘延迟us[:网络延迟us]]]\n", argv[0]);
+                exit(-1);
+        }
     }
-    // p("绑定套接字");
-    
 
-    // p("正在监听套接字...");
-    ret = listen(listen_fd, 5); // 传统为 5
-    if (ret < 0) {
-        pe("监听套接字失败: %m");
+    openlog("FTPServer", LOG_NDELAY, LOG_FTP); // pid 由各条日志自带
+    signal(SIGPIPE, SIG_IGN); // 对端关闭时由 send 返回 EPIPE
+    log_init();
+    namecache_init();
+    cmdcounts_init();
+    xferstats_init();
+    metrics_init();
+    shaper_init();
+    iplimit_init();
+    heat_init();
+#ifdef HAVE_INOTIFY
+    listcache_init();
+#endif
+    tune_init();
+    metrics_spawn();
+
+    if (runmode == MODE_THREADS) {
+#ifdef HAVE_EPOLL
+        threadserve();
+        return 0;
+#else
+        pe("此平台不支持线程模式");
         exit(-1);
+#endif
     }
-    pp("服务器启动在 %s:%d", inet_ntop(AF_INET, &server.sin_addr, buff, sizeof(buff)), ntohs(server.sin_port));
 
-    for (;;) {
-        struct sockaddr_in client;
-        socklen_t len;
-        // p("正在接收连接...");
-        int connect_fd = accept(listen_fd, (struct sockaddr*)&client, &len);
-        if (connect_fd < 0) {
-            pe("接收连接失败: %m");
-            exit(-1);
-        }
-        // p("接收连接");
+    if (workers > 0) {
+        supervise();
+    }
 
-        pp("客户端请求 %s:%d", inet_ntop(AF_INET, &client.sin_addr, buff, sizeof(buff)), ntohs(client.sin_port));
-        pid_t pid = fork();
-        if (pid < 0) {
-            pe("服务器进程创建失败: %m");
-            exit(-1);
-        } else if (pid == 0) {
-            close(listen_fd);
-            // p("关闭监听描述符");
-            ftp_task(connect_fd);
-            close(connect_fd);
-            // p("关闭连接描述符");
-            exit(0);
-        }
-        close(connect_fd);
+    int listen_fd = openlistener();
+    if (listen_fd < 0) {
+        exit(-1);
     }
+    serve(listen_fd);
 
     return 0;
 }
@@ -0,0 +1,97 @@
+#!/bin/bash
+# 分段并发下载测试: 启动服务器, 以 N 个会话各用 RANG+RETR 取回同一文件的一段, 拼接后与原文件比较校验和.
+#
+# 用法 (服务器监听 21 端口并切换用户身份, 需以 root 运行):
+#   sudo tests/ranged_retr.sh 服务器程序 [会话数] [文件MB] [运行模式]
+# 例如:
+#   sudo tests/ranged_retr.sh ./ftpd 8 64 epoll
+#
+# 会话数默认 5, 文件大小默认 20MB, 运行模式默认 fork (可为 fork, epoll, threads).
+# 测试文件建在匿名用户 ftp 的主目录中, 结束后删除; 需要 python3 和 sha256sum.
+# 全部段校验一致时退出码为 0, 否则为 1.
+
+set -u
+
+SERVER=${1:?用法: $0 服务器程序 [会话数] [文件MB] [运行模式]}
+SESSIONS=${2:-5}
+SIZEMB=${3:-20}
+MODE=${4:-fork}
+
+HOME_FTP=$(getent passwd ftp | cut -d: -f6)
+if [ -z "$HOME_FTP" ] || [ ! -d "$HOME_FTP" ]; then
+    echo "没有匿名用户 ftp 或其主目录" >&2
+    exit 1
+fi
+NAME=ranged_retr.$$.bin
+FILE=$HOME_FTP/$NAME
+LOG=$(mktemp)
+
+cleanup() {
+    [ -n "${PID:-}" ] && kill -- -"$PID" 2>/dev/null # 连同会话子进程
+    rm -f "$FILE" "$LOG"
+}
+trap cleanup EXIT
+
+head -c $((SIZEMB * 1024 * 1024)) /dev/urandom > "$FILE" || exit 1
+chmod 644 "$FILE"
+WANT=$(sha256sum "$FILE" | cut -d' ' -f1)
+
+setsid "$SERVER" -m "$MODE" -l error 2>"$LOG" &
+PID=$!
+
+# 等待服务器开始接受连接
+for i in $(seq 50); do
+    python3 -c 'import socket; socket.create_connection(("127.0.0.1", 21), 1).close()' 2>/dev/null && break
+    if ! kill -0 "$PID" 2>/dev/null; then
+        echo "服务器未能启动:" >&2
+        cat "$LOG" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+python3 - "$NAME" "$SESSIONS" "$WANT" <<'PY'
+import ftplib, hashlib, sys, threading
+
+name, n, want = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+
+f = ftplib.FTP()
+f.connect("127.0.0.1", 21, timeout=60)
+f.login("ftp", "test@")
+size = f.size(name)
+f.quit()
+
+step = (size + n - 1) // n
+parts = [None] * n
+errors = []
+
+def fetch(i):
+    start, end = i * step, min(size, (i + 1) * step) - 1 # RANG 的两端都包含在内
+    try:
+        c = ftplib.FTP()
+        c.connect("127.0.0.1", 21, timeout=60)
+        c.login("ftp", "test@")
+        c.voidcmd("TYPE I")
+        c.sendcmd("RANG %d %d" % (start, end))
+        buf = bytearray()
+        c.retrbinary("RETR " + name, buf.extend)
+        c.quit()
+        if len(buf) != end - start + 1:
+            errors.append("第 %d 段: 期望 %d 字节, 收到 %d" % (i, end - start + 1, len(buf)))
+        parts[i] = bytes(buf)
+    except Exception as e:
+        errors.append("第 %d 段: %s" % (i, e))
+
+threads = [threading.Thread(target=fetch, args=(i,)) for i in range(n)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+
+if errors:
+    print("\n".join(errors))
+    sys.exit(1)
+got = hashlib.sha256(b"".join(parts)).hexdigest()
+print("%d 个会话取回 %d 字节, 校验和 %s" % (n, size, "一致" if got == want else "不一致"))
+sys.exit(0 if got == want else 1)
+PY